@@ -1,405 +1,417 @@
 // wfc.cpp
-// Compile with: g++ -std=c++11 wfc.cpp -o wfc
+// Command-line client of the quick_wfc library (oldcode/WFC.h).
+// Compile with: g++ -std=c++2b -pthread inspiration/old_main.cpp oldcode/WFC.cpp -o wfc
 // Make sure to have stb_image_write.h in your include path.
 // You can obtain stb_image_write.h from: https://github.com/nothings/stb
 
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <vector>
 #include <cstdlib>
 #include <ctime>
-#include <limits>
-#include <map>
 #include <string>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <thread>
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "../stb_image_write.h"
+#include "../oldcode/WFC.h"
 
 using namespace std;
 
 //------------------------------------------------------------------------------
-// Enum for Directions.
-enum Direction { NORTH = 0, EAST = 1, SOUTH = 2, WEST = 3 };
-
-// Helper to convert a direction string (case-insensitive) to Direction enum.
-bool parseDirection(const string& dirStr, Direction &dir) {
-    string d = dirStr;
-    for (auto &c : d)
-        c = toupper(c);
-    if (d == "NORTH") { dir = NORTH; return true; }
-    if (d == "EAST")  { dir = EAST;  return true; }
-    if (d == "SOUTH") { dir = SOUTH; return true; }
-    if (d == "WEST")  { dir = WEST;  return true; }
-    return false;
-}
-
-//------------------------------------------------------------------------------
-// Structure for tile definitions.
-struct WFCTileDefinition {
-    string name;
-    int r, g, b;
-};
-
-//------------------------------------------------------------------------------
-// Structure to temporarily hold constraint entries from the input file.
-struct ConstraintEntry {
-    string baseTileName;
-    string dirStr;
-    vector<string> allowedNames;
-};
-
-//------------------------------------------------------------------------------
-// WFCConstraint: Stores allowed neighbor tile types for each direction.
-class WFCConstraint {
-public:
-    // For each of the 4 directions, store allowed tile IDs.
-    vector<int> allowedTiles[4];
-
-    WFCConstraint() {}
-
-    // Utility: Check if a candidate neighbor tile (tileID) is allowed in the given direction.
-    bool allows(Direction dir, int tileID) const {
-        const vector<int>& allowed = allowedTiles[dir];
-        return (find(allowed.begin(), allowed.end(), tileID) != allowed.end());
+// Benchmark: runs each propagator on a few grid sizes and reports the time and
+// the per-cell state it needs, to show the memory/speed trade-off. Then runs
+// every domain width that fits the tile set on the same grid and seed, and
+// reports its speedup over the generic multi-word instantiation.
+int runBenchmark(const string& inputFile) {
+    const int sizes[] = { 32, 64, 128 };
+    const WFC::PropagatorMode modes[] = { WFC::PROPAGATE_BITSET, WFC::PROPAGATE_AC4 };
+    const char* modeNames[] = { "bitset", "ac4" };
+    const uint64_t seed = 1;
+
+    auto rules = WFC::WFCRules::load(inputFile);
+    if (!rules) {
+        cerr << "Error loading input file: " << inputFile << endl;
+        return 1;
     }
-};
-
-//------------------------------------------------------------------------------
-// WFCTile: Represents one cell in the grid with a set of possible tile IDs.
-class WFCTile {
-public:
-    vector<int> possibilities;  // Possible tile type IDs for this cell.
-    bool collapsed;             // Whether the cell has been collapsed.
-    int finalTile;              // Final tile type ID (if collapsed).
-    string finalName;           // Final tile's name (for identification).
 
-    WFCTile(int numTileTypes) : collapsed(false), finalTile(-1), finalName("") {
-        for (int i = 0; i < numTileTypes; i++) {
-            possibilities.push_back(i);
+    cout << left << setw(12) << "propagator" << setw(12) << "grid"
+         << setw(14) << "time (ms)" << setw(18) << "state bytes/cell" << "result" << endl;
+    for (WFC::PropagatorMode mode : modes) {
+        for (int size : sizes) {
+            auto start = chrono::steady_clock::now();
+            auto wfc = WFC::WFC::create(size, size, 1, rules, mode, seed);
+            wfc->run();
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            cout << left << setw(12) << modeNames[mode]
+                 << setw(12) << (to_string(size) + "x" + to_string(size))
+                 << setw(14) << fixed << setprecision(2) << ms
+                 << setw(18) << setprecision(1) << wfc->stateBytesPerCell()
+                 << (wfc->isComplete() ? "complete" : "conflict") << endl;
         }
     }
+    cout << "bitset keeps only the domain bits; ac4 adds 4 uint16_t support counters"
+         << " per tile per cell but only touches compatible tiles on each removal." << endl;
+
+    // Domain widths, widest first so that the generic one is the baseline.
+    const int size = sizes[std::size(sizes) - 1];
+    WFC::DomainWidth narrowest = WFC::narrowestDomainWidth(rules->tileDefinitions.size());
+    cout << endl << left << setw(12) << "domain" << setw(12) << "grid"
+         << setw(14) << "time (ms)" << setw(18) << "state bytes/cell" << setw(10) << "result" << "speedup" << endl;
+    double baselineMs = 0.0;
+    for (WFC::DomainWidth width : { WFC::DOMAIN_WIDE, WFC::DOMAIN_64, WFC::DOMAIN_32, WFC::DOMAIN_16, WFC::DOMAIN_8 }) {
+        if (width != WFC::DOMAIN_WIDE && (narrowest == WFC::DOMAIN_WIDE || width < narrowest))
+            continue;
+        auto start = chrono::steady_clock::now();
+        auto wfc = WFC::WFC::create(size, size, 1, rules, WFC::PROPAGATE_BITSET, seed, width);
+        wfc->run();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (width == WFC::DOMAIN_WIDE)
+            baselineMs = ms;
+        cout << left << setw(12) << WFC::domainWidthName(width)
+             << setw(12) << (to_string(size) + "x" + to_string(size))
+             << setw(14) << fixed << setprecision(2) << ms
+             << setw(18) << setprecision(1) << wfc->stateBytesPerCell()
+             << setw(10) << (wfc->isComplete() ? "complete" : "conflict")
+             << setprecision(2) << baselineMs / ms << "x" << endl;
+    }
 
-    // Collapse the cell by choosing a random possibility.
-    // tileDefs: list of tile definitions used to look up the tile's name.
-    void collapse(const vector<WFCTileDefinition>& tileDefs) {
-        if (!possibilities.empty() && !collapsed) {
-            int index = rand() % possibilities.size();
-            finalTile = possibilities[index];
-            possibilities.clear();
-            possibilities.push_back(finalTile);
-            collapsed = true;
-            finalName = tileDefs[finalTile].name;
+    // Word kernels of wide domains, scalar first so that it is the baseline.
+    if (narrowest == WFC::DOMAIN_WIDE) {
+        vector<string> kernels = WFC::WFCWordKernels::available();
+        string fastest = kernels.front();
+        reverse(kernels.begin(), kernels.end());
+        cout << endl << left << setw(12) << "kernels" << setw(12) << "grid"
+             << setw(14) << "time (ms)" << setw(10) << "result" << "speedup" << endl;
+        for (const string& kernelName : kernels) {
+            WFC::WFCWordKernels::select(kernelName);
+            auto start = chrono::steady_clock::now();
+            auto wfc = WFC::WFC::create(size, size, 1, rules, WFC::PROPAGATE_BITSET, seed, WFC::DOMAIN_WIDE);
+            wfc->run();
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (kernelName == kernels.front())
+                baselineMs = ms;
+            cout << left << setw(12) << kernelName
+                 << setw(12) << (to_string(size) + "x" + to_string(size))
+                 << setw(14) << fixed << setprecision(2) << ms
+                 << setw(10) << (wfc->isComplete() ? "complete" : "conflict")
+                 << baselineMs / ms << "x" << endl;
         }
+        WFC::WFCWordKernels::select(fastest);
     }
-};
-
-//------------------------------------------------------------------------------
-// WFC: Core class that holds the grid, tile definitions, constraints, and runs the algorithm.
-class WFC {
-private:
-    int width, height;
-    int tileSize;  // Pixel size for output image tiles.
 
-public:
-    vector<vector<WFCTile>> grid;
-    vector<WFCConstraint> tileConstraints;          // Global constraints for each tile type.
-    vector<WFCTileDefinition> tileDefinitions;        // Tile definitions (name, color).
-    map<string, int> tileNameToID;                    // Mapping from tile name to tile ID.
-
-    // Constructor: grid dimensions, tile size, and the input file.
-    WFC(int w, int h, int tSize, const string &inputFile)
-        : width(w), height(h), tileSize(tSize)
-    {
-        srand(static_cast<unsigned>(time(0)));
-
-        if (!loadFromFile(inputFile)) {
-            cerr << "Error loading input file: " << inputFile << endl;
-            exit(1);
-        }
+    // Propagation threads, on a grid large enough for long cascades.
+    const int largeSize = 4 * size;
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    vector<int> threadCounts;
+    for (int numThreads = 1; numThreads < maxThreads; numThreads *= 2)
+        threadCounts.push_back(numThreads);
+    threadCounts.push_back(maxThreads);
+    cout << endl << left << setw(12) << "threads" << setw(12) << "grid"
+         << setw(14) << "time (ms)" << setw(10) << "result" << "speedup" << endl;
+    for (int numThreads : threadCounts) {
+        auto start = chrono::steady_clock::now();
+        auto wfc = WFC::WFC::create(largeSize, largeSize, 1, rules, WFC::PROPAGATE_BITSET, seed);
+        wfc->setPropagationThreads(numThreads);
+        wfc->run();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (numThreads == 1)
+            baselineMs = ms;
+        cout << left << setw(12) << numThreads
+             << setw(12) << (to_string(largeSize) + "x" + to_string(largeSize))
+             << setw(14) << fixed << setprecision(2) << ms
+             << setw(10) << (wfc->isComplete() ? "complete" : "conflict")
+             << baselineMs / ms << "x" << endl;
+    }
 
-        // Resize and initialize the constraints vector.
-        int numTileTypes = tileDefinitions.size();
-        tileConstraints.resize(numTileTypes);
-        for (int i = 0; i < numTileTypes; i++) {
-            for (int d = 0; d < 4; d++) {
-                // By default, allow every tile type.
-                for (int j = 0; j < numTileTypes; j++)
-                    tileConstraints[i].allowedTiles[d].push_back(j);
+    // Many small maps: loading the rules and creating a solver per map, as
+    // one process per map does, against one solveBatch() call.
+    const int batchMaps = 1000, batchSize = 16;
+    cout << endl << left << setw(12) << (to_string(batchMaps) + " maps") << setw(12) << "grid"
+         << setw(14) << "time (ms)" << setw(10) << "complete" << "speedup" << endl;
+    for (int batched = 0; batched < 2; batched++) {
+        auto start = chrono::steady_clock::now();
+        int completed = 0;
+        if (batched) {
+            vector<WFC::WFCBatchJob> jobs;
+            for (int i = 0; i < batchMaps; i++)
+                jobs.push_back(WFC::WFCBatchJob{ batchSize, batchSize, seed + i });
+            completed = WFC::solveBatch(rules, jobs, [](size_t, const WFC::WFC&) {});
+        } else {
+            for (int i = 0; i < batchMaps; i++) {
+                auto wfc = WFC::WFC::create(batchSize, batchSize, 1, WFC::WFCRules::load(inputFile), WFC::PROPAGATE_BITSET, seed + i);
+                completed += wfc->run();
             }
         }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (!batched)
+            baselineMs = ms;
+        cout << left << setw(12) << (batched ? "batch" : "per map")
+             << setw(12) << (to_string(batchSize) + "x" + to_string(batchSize))
+             << setw(14) << fixed << setprecision(2) << ms
+             << setw(10) << completed << baselineMs / ms << "x" << endl;
+    }
+    return 0;
+}
 
-        // Initialize the grid.
-        grid.reserve(height);
-        for (int y = 0; y < height; y++) {
-            vector<WFCTile> row;
-            row.reserve(width);
-            for (int x = 0; x < width; x++) {
-                row.push_back(WFCTile(numTileTypes));
+//------------------------------------------------------------------------------
+// Main Function: Create a WFC object, run the algorithm, and generate the output image.
+// Usage: quick_wfc [--propagator bitset|ac4] [--backtrack <limit>]
+//                  [--threads <count>] [--seed <seed>]
+//                  [--domain auto|8|16|32|64|wide]
+//                  [--kernels scalar|avx2|avx512] [--propagate-threads <count>]
+//                  [--world <chunks>] [--out-of-core <width> <height>]
+//                  [--batch <count>] [--jobs <file>] [--grid <width> <height>]
+//                  [--volume <width> <height> <depth>]
+//                  [--topology square|hex|triangle <width> <height>]
+//                  [--mesh <mesh.obj> <4|6 directions>]
+//                  [--sample <image.ppm> <pattern size>] [--symmetry <1-8>]
+//                  [--input <rules.wfcin|rules.wfcr>] [--bench]
+//        quick_wfc [--input <tiles.wfcin>] --learn <output.wfcin|output.wfcr> <map>...
+int main(int argc, char** argv) {
+    // Modify grid parameters as desired.
+    int gridWidth = 20;
+    int gridHeight = 20;
+    int gridDepth = 1;       // More than 1 solves a volume, drawn as its z layers one below the other.
+    string topologyName;     // Solves on a hex or triangle grid, a mesh, or the square grid as a graph.
+    string meshFile;
+    int meshDirections = 4;
+    int tilePixelSize = 32;
+    string inputFile = "input.wfcin"; // Ensure this file exists in your working directory.
+    bool inputGiven = false;
+    WFC::PropagatorMode propagatorMode = WFC::PROPAGATE_BITSET;
+    int backtrackLimit = 0;  // 0 gives up on the first contradiction.
+    int numThreads = 1;      // More than 1 races that many seeds in parallel.
+    int propagateThreads = 1;  // More than 1 splits large propagation cascades across threads.
+    int worldChunks = 0;     // More than 0 generates that many chunks per side of gridWidth cells.
+    bool outOfCore = false;  // Solves a grid of any size band by band into output.tiles.
+    int batchCount = 0;      // More than 0 solves that many grids with seeds seed, seed + 1, ...
+    string jobsFile;         // Runs the jobs listed in this file on a thread pool.
+    string sampleFile;       // Learns overlapping-model rules from this image instead of inputFile.
+    int patternSize = 3;     // Pattern size of the overlapping model.
+    int symmetry = 8;        // Rotations and reflections of the sample to learn from.
+    string learnOutput;      // Learns rules from the example maps and writes them here.
+    vector<string> mapFiles;
+    uint64_t seed = static_cast<uint64_t>(time(0));
+    WFC::DomainWidth domainWidth = WFC::DOMAIN_AUTO;  // Narrowest instantiation that fits the tile set.
+    bool benchmark = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--bench") {
+            benchmark = true;
+        } else if (arg == "--propagator" && i + 1 < argc) {
+            if (!WFC::parsePropagatorMode(argv[++i], propagatorMode)) {
+                cerr << "Unknown propagator: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--backtrack" && i + 1 < argc) {
+            backtrackLimit = atoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            numThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--out-of-core" && i + 2 < argc) {
+            outOfCore = true;
+            gridWidth = max(1, atoi(argv[++i]));
+            gridHeight = max(1, atoi(argv[++i]));
+        } else if (arg == "--input" && i + 1 < argc) {
+            inputFile = argv[++i];
+            inputGiven = true;
+        } else if (arg == "--learn" && i + 2 < argc) {
+            learnOutput = argv[++i];
+            while (i + 1 < argc)
+                mapFiles.push_back(argv[++i]);
+        } else if (arg == "--grid" && i + 2 < argc) {
+            gridWidth = max(1, atoi(argv[++i]));
+            gridHeight = max(1, atoi(argv[++i]));
+        } else if (arg == "--volume" && i + 3 < argc) {
+            gridWidth = max(1, atoi(argv[++i]));
+            gridHeight = max(1, atoi(argv[++i]));
+            gridDepth = max(1, atoi(argv[++i]));
+        } else if (arg == "--topology" && i + 3 < argc) {
+            topologyName = argv[++i];
+            gridWidth = max(1, atoi(argv[++i]));
+            gridHeight = max(1, atoi(argv[++i]));
+        } else if (arg == "--mesh" && i + 2 < argc) {
+            topologyName = "mesh";
+            meshFile = argv[++i];
+            meshDirections = atoi(argv[++i]);
+        } else if (arg == "--sample" && i + 2 < argc) {
+            sampleFile = argv[++i];
+            patternSize = max(1, atoi(argv[++i]));
+            tilePixelSize = 1;
+        } else if (arg == "--symmetry" && i + 1 < argc) {
+            symmetry = clamp(atoi(argv[++i]), 1, 8);
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobsFile = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchCount = max(0, atoi(argv[++i]));
+        } else if (arg == "--world" && i + 1 < argc) {
+            worldChunks = max(0, atoi(argv[++i]));
+        } else if (arg == "--propagate-threads" && i + 1 < argc) {
+            propagateThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--kernels" && i + 1 < argc) {
+            if (!WFC::WFCWordKernels::select(argv[++i])) {
+                cerr << "Unsupported kernels: " << argv[i] << endl;
+                return 1;
             }
-            grid.push_back(row);
+        } else if (arg == "--domain" && i + 1 < argc) {
+            if (!WFC::parseDomainWidth(argv[++i], domainWidth)) {
+                cerr << "Unknown domain width: " << argv[i] << endl;
+                return 1;
+            }
+        } else {
+            cerr << "Unknown argument: " << arg << endl;
+            return 1;
         }
     }
 
-    // Parses a .wfcin input file.
-    // Expected file structure:
-    //   [WFINPUT]
-    //   [Tiles]
-    //   Red 255 0 0
-    //   Green 0 255 0
-    //   Blue 0 0 255
-    //
-    //   [Constraints]
-    //   Red NORTH Green Blue
-    //   Red EAST Blue
-    //   Green SOUTH Red Blue
-    //   Green WEST Red Blue
-    //   Blue NORTH Red
-    //   Blue EAST Green
-    //
-    // Lines starting with '#' or ';' are treated as comments.
-    bool loadFromFile(const string &filename) {
-        ifstream infile(filename);
-        if (!infile.is_open()) {
-            cerr << "Failed to open file: " << filename << endl;
-            return false;
-        }
-
-        string line;
-        enum Section { NONE, TILES, CONSTRAINTS } currentSection = NONE;
-        bool headerRead = false;
-        vector<ConstraintEntry> constraintEntries;
-
-        while (getline(infile, line)) {
-            // Trim whitespace.
-            if(line.empty()) continue;
-            // Skip comment lines.
-            if(line[0] == '#' || line[0] == ';')
-                continue;
+    if (benchmark)
+        return runBenchmark(inputFile);
 
-            // Check for section headers.
-            if (line[0] == '[') {
-                if (line.find("WFINPUT") != string::npos) {
-                    headerRead = true;
-                    currentSection = NONE;
-                } else if (line.find("Tiles") != string::npos) {
-                    if(!headerRead) {
-                        cerr << "Missing [WFINPUT] header." << endl;
-                        return false;
-                    }
-                    currentSection = TILES;
-                } else if (line.find("Constraints") != string::npos) {
-                    currentSection = CONSTRAINTS;
-                } else {
-                    currentSection = NONE;
-                }
-                continue;
-            }
-
-            // Process lines according to the current section.
-            istringstream iss(line);
-            if (currentSection == TILES) {
-                // Format: <TileName> <R> <G> <B>
-                string tileName;
-                int r, g, b;
-                if (!(iss >> tileName >> r >> g >> b)) {
-                    cerr << "Invalid tile definition: " << line << endl;
-                    continue;
-                }
-                WFCTileDefinition def;
-                def.name = tileName;
-                def.r = r;
-                def.g = g;
-                def.b = b;
-                tileNameToID[tileName] = tileDefinitions.size();
-                tileDefinitions.push_back(def);
-            } else if (currentSection == CONSTRAINTS) {
-                // Format: <TileName> <Direction> <AllowedTileName1> [AllowedTileName2] ...
-                ConstraintEntry entry;
-                if (!(iss >> entry.baseTileName >> entry.dirStr)) {
-                    cerr << "Invalid constraint line (missing fields): " << line << endl;
-                    continue;
-                }
-                string allowedTileName;
-                while (iss >> allowedTileName) {
-                    entry.allowedNames.push_back(allowedTileName);
-                }
-                constraintEntries.push_back(entry);
-            }
+    if (!learnOutput.empty()) {
+        // Learns over the tiles of --input when it is given, otherwise over
+        // the tile names found in the maps.
+        shared_ptr<const WFC::WFCRules> tileSet;
+        if (inputGiven && !(tileSet = WFC::WFCRules::load(inputFile))) {
+            cerr << "Error loading input file: " << inputFile << endl;
+            return 1;
         }
-        infile.close();
+        WFC::WFCRuleLearner learner(tileSet);
+        auto start = chrono::steady_clock::now();
+        for (const string& mapFile : mapFiles)
+            if (!learner.addFile(mapFile))
+                return 1;
+        auto learned = learner.rules();
+        if (!learned)
+            return 1;
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        bool text = learnOutput.size() >= 6 && learnOutput.compare(learnOutput.size() - 6, 6, ".wfcin") == 0;
+        if (!(text ? learned->saveText(learnOutput) : learned->saveBinary(learnOutput)))
+            return 1;
+        cout << "Learned " << learned->tileDefinitions.size() << " tiles from " << mapFiles.size() << " files in "
+             << fixed << setprecision(2) << ms << " ms, written to " << learnOutput << endl;
+        return 0;
+    }
 
-        if (tileDefinitions.empty()) {
-            cerr << "No tile definitions were loaded." << endl;
-            return false;
-        }
-        // Now that we have tile definitions, apply the constraints.
-        int numTileTypes = tileDefinitions.size();
-        // At this point, tileConstraints is resized and filled with default values by the constructor.
-        // We now override defaults from the input file.
-        for (auto &entry : constraintEntries) {
-            Direction d;
-            if (!parseDirection(entry.dirStr, d)) {
-                cerr << "Invalid direction in constraint: " << entry.dirStr << endl;
-                continue;
-            }
-            if (tileNameToID.find(entry.baseTileName) == tileNameToID.end()) {
-                cerr << "Unknown tile name in constraints: " << entry.baseTileName << endl;
-                continue;
-            }
-            int baseTileID = tileNameToID[entry.baseTileName];
-            // Clear default allowed list for the given direction.
-            tileConstraints[baseTileID].allowedTiles[d].clear();
-            for (const auto &allowedName : entry.allowedNames) {
-                if (tileNameToID.find(allowedName) == tileNameToID.end()) {
-                    cerr << "Unknown allowed tile name: " << allowedName << endl;
-                    continue;
-                }
-                int allowedID = tileNameToID[allowedName];
-                tileConstraints[baseTileID].allowedTiles[d].push_back(allowedID);
-            }
+    shared_ptr<const WFC::WFCRules> rules;
+    if (!sampleFile.empty()) {
+        WFC::WFCSample sample;
+        if (!sample.load(sampleFile))
+            return 1;
+        auto start = chrono::steady_clock::now();
+        rules = WFC::WFCRules::fromSample(sample, patternSize, symmetry);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (!rules)
+            return 1;
+        cout << "Learned " << rules->tileDefinitions.size() << " patterns from " << sample.width << "x"
+             << sample.height << " sample in " << fixed << setprecision(2) << ms << " ms" << endl;
+    } else {
+        rules = WFC::WFCRules::load(inputFile);
+        if (!rules) {
+            cerr << "Error loading input file: " << inputFile << endl;
+            return 1;
         }
-        return true;
     }
 
-    // Runs the collapse and propagation process until all cells are collapsed.
-    void run() {
-        while (!isComplete()) {
-            int minEntropy = std::numeric_limits<int>::max();
-            int chosenX = -1, chosenY = -1;
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    if (!grid[y][x].collapsed) {
-                        int possCount = grid[y][x].possibilities.size();
-                        if (possCount < minEntropy && possCount > 0) {
-                            minEntropy = possCount;
-                            chosenX = x;
-                            chosenY = y;
-                        }
-                    }
-                }
-            }
-            if (chosenX == -1 || chosenY == -1) {
-                cout << "No valid cell to collapse. A conflict may have occurred." << endl;
-                return;
-            }
-            grid[chosenY][chosenX].collapse(tileDefinitions);
-            propagate();
-        }
+    if (outOfCore) {
+        return WFC::solveOutOfCore(rules, gridWidth, gridHeight, seed, "output.tiles", "output.ppm", 1,
+                              propagatorMode, 64, max(backtrackLimit, 1000)) ? 0 : 1;
     }
 
-    // Propagates constraints to update possible tile values.
-    void propagate() {
-        bool changed = true;
-        int numTileTypes = tileDefinitions.size();
-        while (changed) {
-            changed = false;
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    if (!grid[y][x].collapsed) {
-                        vector<int> newPossibilities;
-                        for (int candidate : grid[y][x].possibilities) {
-                            bool valid = true;
-                            // North neighbor
-                            if (y > 0 && grid[y-1][x].collapsed) {
-                                int neighborTile = grid[y-1][x].finalTile;
-                                if (!tileConstraints[candidate].allows(NORTH, neighborTile))
-                                    valid = false;
-                            }
-                            // South neighbor
-                            if (y < height-1 && grid[y+1][x].collapsed) {
-                                int neighborTile = grid[y+1][x].finalTile;
-                                if (!tileConstraints[candidate].allows(SOUTH, neighborTile))
-                                    valid = false;
-                            }
-                            // West neighbor
-                            if (x > 0 && grid[y][x-1].collapsed) {
-                                int neighborTile = grid[y][x-1].finalTile;
-                                if (!tileConstraints[candidate].allows(WEST, neighborTile))
-                                    valid = false;
-                            }
-                            // East neighbor
-                            if (x < width-1 && grid[y][x+1].collapsed) {
-                                int neighborTile = grid[y][x+1].finalTile;
-                                if (!tileConstraints[candidate].allows(EAST, neighborTile))
-                                    valid = false;
-                            }
-                            if (valid)
-                                newPossibilities.push_back(candidate);
-                        }
-                        if (newPossibilities.size() < grid[y][x].possibilities.size()) {
-                            grid[y][x].possibilities = newPossibilities;
-                            changed = true;
-                            if (grid[y][x].possibilities.size() == 1)
-                                grid[y][x].collapse(tileDefinitions);
-                        }
-                    }
-                }
-            }
+    if (!jobsFile.empty()) {
+        vector<WFC::WFCJob> jobs;
+        if (!WFC::loadJobs(jobsFile, jobs))
+            return 1;
+        int poolThreads = numThreads > 1 ? numThreads : max(1u, thread::hardware_concurrency());
+        auto start = chrono::steady_clock::now();
+        vector<WFC::WFCJobReport> reports = WFC::runJobs(rules, jobs, poolThreads, tilePixelSize, propagatorMode, backtrackLimit);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << left << setw(6) << "job" << setw(12) << "grid" << setw(12) << "solve (ms)" << setw(13) << "render (ms)"
+             << setw(13) << "encode (ms)" << setw(14) << "latency (ms)" << "result" << endl;
+        int completed = 0;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const WFC::WFCJobReport& report = reports[i];
+            completed += report.complete;
+            cout << left << setw(6) << i
+                 << setw(12) << (to_string(jobs[i].width) + "x" + to_string(jobs[i].height))
+                 << fixed << setprecision(2) << setw(12) << report.solveMs << setw(13) << report.renderMs
+                 << setw(13) << report.encodeMs << setw(14) << report.latencyMs
+                 << (report.complete ? jobs[i].outputFile : string("failed")) << endl;
         }
+        cout << "Completed " << completed << " of " << jobs.size() << " jobs on " << poolThreads
+             << " threads in " << fixed << setprecision(2) << ms << " ms" << endl;
+        return completed == (int)jobs.size() ? 0 : 1;
     }
 
-    // Returns true if every cell in the grid is collapsed.
-    bool isComplete() const {
-        for (int y = 0; y < height; y++)
-            for (int x = 0; x < width; x++)
-                if (!grid[y][x].collapsed)
-                    return false;
-        return true;
+    if (batchCount > 0) {
+        vector<WFC::WFCBatchJob> jobs;
+        for (int i = 0; i < batchCount; i++)
+            jobs.push_back(WFC::WFCBatchJob{ gridWidth, gridHeight, seed + i });
+        auto start = chrono::steady_clock::now();
+        int completed = WFC::solveBatch(rules, jobs, [](size_t, const WFC::WFC&) {}, propagatorMode, backtrackLimit);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Completed " << completed << " of " << batchCount << " grids in "
+             << fixed << setprecision(2) << ms << " ms" << endl;
+        return completed == batchCount ? 0 : 1;
     }
 
-    // Generates an image (PNG) based on the final collapsed grid.
-    void generateImage(const string& filename) {
-        int imageWidth = width * tileSize;
-        int imageHeight = height * tileSize;
-        int channels = 3; // RGB
-
-        vector<unsigned char> image(imageWidth * imageHeight * channels, 255);
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                int tileID = grid[y][x].finalTile;
-                int r = 200, g = 200, b = 200;
-                if (tileID >= 0 && tileID < (int)tileDefinitions.size()) {
-                    r = tileDefinitions[tileID].r;
-                    g = tileDefinitions[tileID].g;
-                    b = tileDefinitions[tileID].b;
-                }
-                for (int ty = 0; ty < tileSize; ty++) {
-                    int py = y * tileSize + ty;
-                    for (int tx = 0; tx < tileSize; tx++) {
-                        int px = x * tileSize + tx;
-                        int index = (py * imageWidth + px) * channels;
-                        image[index+0] = r;
-                        image[index+1] = g;
-                        image[index+2] = b;
-                    }
-                }
-            }
+    if (worldChunks > 0) {
+        WFC::WFCWorld world(rules, gridWidth, seed, propagatorMode, max(backtrackLimit, 1000));
+        if (!world.generateImage("output.png", 0, 0, worldChunks - 1, worldChunks - 1, tilePixelSize)) {
+            cout << "World generation did not complete successfully (some chunks could not be generated)." << endl;
+            return 1;
         }
-        if (stbi_write_png(filename.c_str(), imageWidth, imageHeight, channels, image.data(), imageWidth * channels))
-            cout << "Image generated: " << filename << endl;
-        else
-            cerr << "Error writing image file." << endl;
+        return 0;
     }
-};
 
-//------------------------------------------------------------------------------
-// Main Function: Create a WFC object, run the algorithm, and generate the output image.
-int main() {
-    // Modify grid parameters as desired.
-    int gridWidth = 20;
-    int gridHeight = 20;
-    int tilePixelSize = 32;
-    string inputFile = "input.wfcin"; // Ensure this file exists in your working directory.
+    shared_ptr<const WFC::WFCTopology> topology;
+    if (topologyName == "square") {
+        topology = WFC::WFCTopology::square(gridWidth, gridHeight);
+    } else if (topologyName == "hex") {
+        topology = WFC::WFCTopology::hex(gridWidth, gridHeight);
+    } else if (topologyName == "triangle") {
+        topology = WFC::WFCTopology::triangle(gridWidth, gridHeight);
+    } else if (topologyName == "mesh") {
+        if (!(topology = WFC::WFCTopology::loadMesh(meshFile, meshDirections)))
+            return 1;
+    } else if (!topologyName.empty()) {
+        cerr << "Unknown topology: " << topologyName << endl;
+        return 1;
+    }
 
-    WFC wfc(gridWidth, gridHeight, tilePixelSize, inputFile);
-    wfc.run();
+    unique_ptr<WFC::WFC> wfc;
+    if (topology) {
+        wfc = WFC::WFC::createGraph(topology, tilePixelSize, rules, propagatorMode, seed, domainWidth);
+        wfc->setBacktrackLimit(backtrackLimit);
+        wfc->setPropagationThreads(propagateThreads);
+        wfc->run();
+    } else if (numThreads > 1 && gridDepth == 1) {
+        wfc = WFC::solvePortfolio(rules, gridWidth, gridHeight, tilePixelSize, numThreads, seed,
+                             propagatorMode, backtrackLimit, 100, domainWidth);
+        if (wfc)
+            cout << "Solved with seed " << wfc->getSeed() << endl;
+    } else if (gridDepth > 1) {
+        wfc = WFC::WFC::createVolume(gridWidth, gridHeight, gridDepth, tilePixelSize, rules, propagatorMode, seed,
+                                     domainWidth);
+        wfc->setBacktrackLimit(backtrackLimit);
+        wfc->setPropagationThreads(propagateThreads);
+        wfc->run();
+    } else {
+        wfc = WFC::WFC::create(gridWidth, gridHeight, tilePixelSize, rules, propagatorMode, seed, domainWidth);
+        wfc->setBacktrackLimit(backtrackLimit);
+        wfc->setPropagationThreads(propagateThreads);
+        wfc->run();
+    }
 
-    if (!wfc.isComplete()) {
+    if (!wfc || !wfc->isComplete()) {
         cout << "WFC algorithm did not complete successfully (a conflict may have occurred)." << endl;
         return 1;
     }
-    wfc.generateImage("output.png");
+    wfc->generateImage("output.png");
 
     return 0;
-}
\ No newline at end of file
+}
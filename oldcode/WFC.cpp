@@ -4,10 +4,2928 @@
 
 #include "WFC.h"
 
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <barrier>
+#include <numbers>
+#include <numeric>
+#include <tuple>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_STATIC
+#include "../stb_image_write.h"
+
+using namespace std;
+
 namespace WFC
 {
-    void wfc()
+
+//------------------------------------------------------------------------------
+// Directions.
+bool parseDirection(const string& dirStr, Direction &dir) {
+    string d = dirStr;
+    for (auto &c : d)
+        c = toupper(c);
+    if (d == "NORTH") { dir = NORTH; return true; }
+    if (d == "EAST")  { dir = EAST;  return true; }
+    if (d == "SOUTH") { dir = SOUTH; return true; }
+    if (d == "WEST")  { dir = WEST;  return true; }
+    if (d == "UP")    { dir = UP;    return true; }
+    if (d == "DOWN")  { dir = DOWN;  return true; }
+    if (d == "NORTHEAST") { dir = NORTHEAST; return true; }
+    if (d == "NORTHWEST") { dir = NORTHWEST; return true; }
+    if (d == "SOUTHEAST") { dir = SOUTHEAST; return true; }
+    if (d == "SOUTHWEST") { dir = SOUTHWEST; return true; }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Structure to temporarily hold constraint entries from the input file.
+struct ConstraintEntry {
+    string baseTileName;
+    string dirStr;
+    vector<string> allowedNames;
+};
+
+// Tile symmetry classes: how many distinct orientations a tile has and how a
+// clockwise quarter turn and a left-right mirror permute them. Variant k < 4
+// is the base orientation turned k quarter turns clockwise; the F variants
+// 4..7 are the mirrored base turned the same way.
+struct SymmetryClass {
+    char name;
+    int cardinality;
+    int rotate[8];
+    int mirror[8];
+};
+
+static const SymmetryClass SYMMETRY_CLASSES[] = {
+    { 'X', 1, { 0 },                      { 0 } },                      // +
+    { 'I', 2, { 1, 0 },                   { 0, 1 } },                   // |
+    { '\\', 2, { 1, 0 },                  { 1, 0 } },                   // \ (diagonal)
+    { 'T', 4, { 1, 2, 3, 0 },             { 0, 3, 2, 1 } },             // T (stem SOUTH)
+    { 'L', 4, { 1, 2, 3, 0 },             { 3, 2, 1, 0 } },             // L (NORTH and EAST)
+    { 'F', 8, { 1, 2, 3, 0, 5, 6, 7, 4 }, { 4, 7, 6, 5, 0, 3, 2, 1 } }, // no symmetry
+};
+
+static const SymmetryClass* parseSymmetryClass(const string& s) {
+    if (s.size() != 1)
+        return nullptr;
+    for (const auto& symmetry : SYMMETRY_CLASSES)
+        if (symmetry.name == s[0])
+            return &symmetry;
+    return nullptr;
+}
+
+//------------------------------------------------------------------------------
+// WFCWordKernels: Scalar, AVX2 and AVX-512 implementations.
+
+// Scalar union of rows, restricted to words [first, numWords).
+static void unionOfRowsFrom(uint64_t* out, const uint64_t* rows, const uint64_t* domain, int numWords, int first) {
+    for (int i = first; i < numWords; i++)
+        out[i] = 0;
+    for (int w = 0; w < numWords; w++) {
+        for (uint64_t bits = domain[w]; bits; bits &= bits - 1) {
+            const uint64_t* r = rows + (size_t)(w * 64 + countr_zero(bits)) * numWords;
+            for (int i = first; i < numWords; i++)
+                out[i] |= r[i];
+        }
+    }
+}
+
+static void unionOfRowsScalar(uint64_t* out, const uint64_t* rows, const uint64_t* domain, int numWords) {
+    unionOfRowsFrom(out, rows, domain, numWords, 0);
+}
+
+static bool removesAnyScalar(const uint64_t* dst, const uint64_t* src, int numWords) {
+    for (int i = 0; i < numWords; i++)
+        if (dst[i] & ~src[i])
+            return true;
+    return false;
+}
+
+static const WFCWordKernels scalarKernels = { "scalar", unionOfRowsScalar, removesAnyScalar };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WFC_X86_KERNELS 1
+
+// The vector kernels walk the domain once per block of output words and keep
+// the block in registers while OR-ing in the rows.
+__attribute__((target("avx2")))
+static void unionOfRowsAVX2(uint64_t* out, const uint64_t* rows, const uint64_t* domain, int numWords) {
+    int c = 0;
+    for (; c + 16 <= numWords; c += 16) {
+        __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+        for (int w = 0; w < numWords; w++) {
+            for (uint64_t bits = domain[w]; bits; bits &= bits - 1) {
+                const uint64_t* r = rows + (size_t)(w * 64 + countr_zero(bits)) * numWords + c;
+                a0 = _mm256_or_si256(a0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r)));
+                a1 = _mm256_or_si256(a1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r + 4)));
+                a2 = _mm256_or_si256(a2, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r + 8)));
+                a3 = _mm256_or_si256(a3, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r + 12)));
+            }
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + c), a0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + c + 4), a1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + c + 8), a2);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + c + 12), a3);
+    }
+    for (; c + 4 <= numWords; c += 4) {
+        __m256i a = _mm256_setzero_si256();
+        for (int w = 0; w < numWords; w++)
+            for (uint64_t bits = domain[w]; bits; bits &= bits - 1)
+                a = _mm256_or_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                        rows + (size_t)(w * 64 + countr_zero(bits)) * numWords + c)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + c), a);
+    }
+    if (c < numWords)
+        unionOfRowsFrom(out, rows, domain, numWords, c);
+}
+
+__attribute__((target("avx2")))
+static bool removesAnyAVX2(const uint64_t* dst, const uint64_t* src, int numWords) {
+    int i = 0;
+    for (; i + 4 <= numWords; i += 4) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        // testc is 1 when ~s & d is all zero.
+        if (!_mm256_testc_si256(s, d))
+            return true;
+    }
+    return removesAnyScalar(dst + i, src + i, numWords - i);
+}
+
+__attribute__((target("avx512f")))
+static void unionOfRowsAVX512(uint64_t* out, const uint64_t* rows, const uint64_t* domain, int numWords) {
+    int c = 0;
+    for (; c + 16 <= numWords; c += 16) {
+        __m512i a0 = _mm512_setzero_si512(), a1 = a0;
+        for (int w = 0; w < numWords; w++) {
+            for (uint64_t bits = domain[w]; bits; bits &= bits - 1) {
+                const uint64_t* r = rows + (size_t)(w * 64 + countr_zero(bits)) * numWords + c;
+                a0 = _mm512_or_si512(a0, _mm512_loadu_si512(r));
+                a1 = _mm512_or_si512(a1, _mm512_loadu_si512(r + 8));
+            }
+        }
+        _mm512_storeu_si512(out + c, a0);
+        _mm512_storeu_si512(out + c + 8, a1);
+    }
+    for (; c + 8 <= numWords; c += 8) {
+        __m512i a = _mm512_setzero_si512();
+        for (int w = 0; w < numWords; w++)
+            for (uint64_t bits = domain[w]; bits; bits &= bits - 1)
+                a = _mm512_or_si512(a, _mm512_loadu_si512(rows + (size_t)(w * 64 + countr_zero(bits)) * numWords + c));
+        _mm512_storeu_si512(out + c, a);
+    }
+    if (c < numWords)
+        unionOfRowsFrom(out, rows, domain, numWords, c);
+}
+
+__attribute__((target("avx512f")))
+static bool removesAnyAVX512(const uint64_t* dst, const uint64_t* src, int numWords) {
+    int i = 0;
+    for (; i + 8 <= numWords; i += 8) {
+        __m512i d = _mm512_loadu_si512(dst + i);
+        __m512i s = _mm512_loadu_si512(src + i);
+        // A lane loses tiles when d & s differs from d.
+        if (_mm512_cmpneq_epi64_mask(_mm512_and_si512(d, s), d))
+            return true;
+    }
+    return removesAnyAVX2(dst + i, src + i, numWords - i);
+}
+
+static const WFCWordKernels avx2Kernels = { "avx2", unionOfRowsAVX2, removesAnyAVX2 };
+static const WFCWordKernels avx512Kernels = { "avx512", unionOfRowsAVX512, removesAnyAVX512 };
+#endif
+
+vector<string> WFCWordKernels::available() {
+    vector<string> names;
+#ifdef WFC_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        names.push_back(avx512Kernels.name);
+    if (__builtin_cpu_supports("avx2"))
+        names.push_back(avx2Kernels.name);
+#endif
+    names.push_back(scalarKernels.name);
+    return names;
+}
+
+bool WFCWordKernels::select(const string& kernelName) {
+    vector<string> names = available();
+    if (find(names.begin(), names.end(), kernelName) == names.end())
+        return false;
+#ifdef WFC_X86_KERNELS
+    if (kernelName == avx512Kernels.name) { current() = &avx512Kernels; return true; }
+    if (kernelName == avx2Kernels.name)   { current() = &avx2Kernels;   return true; }
+#endif
+    current() = &scalarKernels;
+    return true;
+}
+
+const WFCWordKernels*& WFCWordKernels::current() {
+    static const WFCWordKernels* kernels = [] {
+        string fastest = available().front();
+#ifdef WFC_X86_KERNELS
+        if (fastest == avx512Kernels.name) return &avx512Kernels;
+        if (fastest == avx2Kernels.name)   return &avx2Kernels;
+#endif
+        return &scalarKernels;
+    }();
+    return kernels;
+}
+
+//------------------------------------------------------------------------------
+// WFCDomain: View of the bitset of tile IDs that are still possible for a cell.
+// The words live in a flat buffer owned by the solver (numWords() words per
+// cell), so domains are contiguous in memory and creating or modifying one
+// never allocates. Word is the storage type and FixedWords the number of words
+// when it is known at compile time (0 for a width chosen at runtime), so that
+// small tile sets compile down to single-register operations. Runtime-width
+// domains of at least KERNEL_MIN_WORDS words go through WFCWordKernels.
+template <typename Word = uint64_t, int FixedWords = 0>
+class WFCDomain {
+private:
+    Word* words;
+    int wordCount;
+
+    static constexpr bool HAS_KERNELS = FixedWords == 0 && is_same_v<Word, uint64_t>;
+    static constexpr int KERNEL_MIN_WORDS = 4;
+
+public:
+    static constexpr int BITS = numeric_limits<Word>::digits;
+
+    WFCDomain(Word* data, int numWords) : words(data), wordCount(FixedWords ? FixedWords : numWords) {}
+
+    int numWords() const { return FixedWords ? FixedWords : wordCount; }
+    Word* data() { return words; }
+    const Word* data() const { return words; }
+
+    // Sets every tile ID in [0, numTileTypes).
+    void fill(int numTileTypes) {
+        for (int i = 0; i < numWords(); i++)
+            words[i] = static_cast<Word>(~Word(0));
+        if (numTileTypes % BITS != 0)
+            words[numWords() - 1] = static_cast<Word>((Word(1) << (numTileTypes % BITS)) - 1);
+    }
+
+    bool test(int tileID) const { return (data()[tileID / BITS] >> (tileID % BITS)) & 1; }
+    void set(int tileID) { data()[tileID / BITS] |= static_cast<Word>(Word(1) << (tileID % BITS)); }
+    void reset(int tileID) { data()[tileID / BITS] &= static_cast<Word>(~(Word(1) << (tileID % BITS))); }
+
+    // Removes every tile except tileID.
+    void assign(int tileID) {
+        clear();
+        set(tileID);
+    }
+
+    void clear() {
+        Word* w = data();
+        for (int i = 0; i < numWords(); i++)
+            w[i] = 0;
+    }
+
+    // Intersects this domain with another one of the same width.
+    void intersect(const WFCDomain& other) {
+        Word* w = data();
+        const Word* o = other.data();
+        for (int i = 0; i < numWords(); i++)
+            w[i] &= o[i];
+    }
+
+    // Intersects this domain with another one and calls f(tileID) for each
+    // tile that was removed.
+    template <typename F>
+    void intersect(const WFCDomain& other, F onRemoved) {
+        Word* w = data();
+        const Word* o = other.data();
+        if constexpr (HAS_KERNELS) {
+            // Most intersections remove nothing; find out without the
+            // per-word branches.
+            if (numWords() >= KERNEL_MIN_WORDS && !WFCWordKernels::active().removesAny(w, o, numWords()))
+                return;
+        }
+        for (int i = 0; i < numWords(); i++) {
+            Word removed = w[i] & static_cast<Word>(~o[i]);
+            if (!removed)
+                continue;
+            w[i] &= o[i];
+            while (removed) {
+                onRemoved(i * BITS + countr_zero(removed));
+                removed &= removed - 1;
+            }
+        }
+    }
+
+    // Sets this domain to the union of rows[t], rows of numWords() words
+    // stored one after the other, over the tiles t of another domain.
+    void assignUnionOfRows(const Word* rows, const WFCDomain& from) {
+        Word* w = data();
+        if constexpr (HAS_KERNELS) {
+            if (numWords() >= KERNEL_MIN_WORDS) {
+                WFCWordKernels::active().unionOfRows(w, rows, from.data(), numWords());
+                return;
+            }
+        }
+        clear();
+        from.forEach([&](int tileID) {
+            const Word* row = rows + (size_t)tileID * numWords();
+            for (int i = 0; i < numWords(); i++)
+                w[i] |= row[i];
+        });
+    }
+
+    int count() const {
+        const Word* w = data();
+        int total = 0;
+        for (int i = 0; i < numWords(); i++)
+            total += popcount(w[i]);
+        return total;
+    }
+
+    bool empty() const { return count() == 0; }
+
+    // Returns the n-th (0-based) tile ID still in the domain, or -1.
+    int nth(int n) const {
+        const Word* w = data();
+        for (int i = 0; i < numWords(); i++) {
+            int c = popcount(w[i]);
+            if (n < c) {
+                Word bits = w[i];
+                for (; n > 0; n--)
+                    bits &= bits - 1;
+                return i * BITS + countr_zero(bits);
+            }
+            n -= c;
+        }
+        return -1;
+    }
+
+    // Calls f(tileID) for each tile in the domain. The domain may be modified
+    // from inside f; each word is read once before its bits are visited.
+    template <typename F>
+    void forEach(F f) const {
+        const Word* w = data();
+        for (int i = 0; i < numWords(); i++) {
+            Word bits = w[i];
+            while (bits) {
+                f(i * BITS + countr_zero(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+// WFCRules: Loading and compiling .wfcin files.
+bool WFCRules::loadFromFile(const string &filename) {
+    ifstream infile(filename);
+    if (!infile.is_open()) {
+        cerr << "Failed to open file: " << filename << endl;
+        return false;
+    }
+
+    string line;
+    enum Section { NONE, TILES, CONSTRAINTS } currentSection = NONE;
+    bool headerRead = false;
+    vector<ConstraintEntry> constraintEntries;
+    vector<const SymmetryClass*> tileSymmetry;  // per tile, nullptr if none
+    vector<int> tileVariant;                    // orientation index within its class
+
+    while (getline(infile, line)) {
+        // Trim whitespace.
+        if(line.empty()) continue;
+        // Skip comment lines.
+        if(line[0] == '#' || line[0] == ';')
+            continue;
+
+        // Check for section headers.
+        if (line[0] == '[') {
+            if (line.find("WFINPUT") != string::npos) {
+                headerRead = true;
+                currentSection = NONE;
+            } else if (line.find("Tiles") != string::npos) {
+                if(!headerRead) {
+                    cerr << "Missing [WFINPUT] header." << endl;
+                    return false;
+                }
+                currentSection = TILES;
+            } else if (line.find("Constraints") != string::npos) {
+                currentSection = CONSTRAINTS;
+            } else {
+                currentSection = NONE;
+            }
+            continue;
+        }
+
+        // Process lines according to the current section.
+        istringstream iss(line);
+        if (currentSection == TILES) {
+            // Format: <TileName> <R> <G> <B> [Weight] [Symmetry]
+            string tileName;
+            int r, g, b;
+            if (!(iss >> tileName >> r >> g >> b)) {
+                cerr << "Invalid tile definition: " << line << endl;
+                continue;
+            }
+            double weight = 1.0;
+            const SymmetryClass* symmetry = nullptr;
+            string token;
+            bool valid = true;
+            while (valid && iss >> token) {
+                if (const SymmetryClass* s = parseSymmetryClass(token)) {
+                    symmetry = s;
+                    continue;
+                }
+                istringstream weightStream(token);
+                valid = (weightStream >> weight) && weightStream.eof();
+            }
+            if (!valid) {
+                cerr << "Invalid tile weight or symmetry: " << line << endl;
+                continue;
+            }
+            if (!(weight > 0.0)) {
+                cerr << "Tile weight must be positive: " << line << endl;
+                continue;
+            }
+            // A tile with a symmetry class becomes one tile per distinct
+            // orientation: <TileName> for the base and <TileName>:<k> for
+            // the others, all sharing its color and weight.
+            int variants = symmetry ? symmetry->cardinality : 1;
+            for (int k = 0; k < variants; k++) {
+                WFCTileDefinition def;
+                def.name = k == 0 ? tileName : tileName + ":" + to_string(k);
+                def.r = r;
+                def.g = g;
+                def.b = b;
+                def.weight = weight;
+                def.weightLogWeight = weight * log(weight);
+                tileNameToID[def.name] = tileDefinitions.size();
+                tileSymmetry.push_back(symmetry);
+                tileVariant.push_back(k);
+                tileDefinitions.push_back(def);
+            }
+        } else if (currentSection == CONSTRAINTS) {
+            // Format: <TileName> <Direction> <AllowedTileName1> [AllowedTileName2] ...
+            ConstraintEntry entry;
+            if (!(iss >> entry.baseTileName >> entry.dirStr)) {
+                cerr << "Invalid constraint line (missing fields): " << line << endl;
+                continue;
+            }
+            string allowedTileName;
+            while (iss >> allowedTileName) {
+                entry.allowedNames.push_back(allowedTileName);
+            }
+            constraintEntries.push_back(entry);
+        }
+    }
+    infile.close();
+
+    if (tileDefinitions.empty()) {
+        cerr << "No tile definitions were loaded." << endl;
+        return false;
+    }
+    // Now that we have tile definitions, apply the constraints.
+    int numTileTypes = tileDefinitions.size();
+    // By default, allow every tile type in every direction.
+    vector<vector<bool>> declared[NUM_DIRECTIONS];
+    for (int d = 0; d < NUM_DIRECTIONS; d++)
+        declared[d].assign(numTileTypes, vector<bool>(numTileTypes, true));
+    // "<TileName>:0" names the base orientation like "<TileName>" does.
+    auto findTile = [&](const string& name) {
+        auto it = tileNameToID.find(name);
+        if (it == tileNameToID.end() && name.size() > 2 && name.ends_with(":0"))
+            it = tileNameToID.find(name.substr(0, name.size() - 2));
+        return it == tileNameToID.end() ? -1 : it->second;
+    };
+    // Applies a mirror (if any) followed by `turns` clockwise quarter turns
+    // to a tile; tiles without a symmetry class are left as they are.
+    auto transformTile = [&](int tileID, bool mirrored, int turns) {
+        const SymmetryClass* symmetry = tileSymmetry[tileID];
+        if (!symmetry)
+            return tileID;
+        int base = tileID - tileVariant[tileID];
+        int k = tileVariant[tileID];
+        if (mirrored)
+            k = symmetry->mirror[k];
+        for (int t = 0; t < turns; t++)
+            k = symmetry->rotate[k];
+        return base + k;
+    };
+    // We now override defaults from the input file. A line whose base tile
+    // has a symmetry class holds for every rotation and reflection of the
+    // whole neighborhood, so it is written into all eight transformed rows.
+    // A line replaces the rows it writes, as a later line for the same tile
+    // and direction replaces an earlier one.
+    vector<int> writtenBy[NUM_DIRECTIONS];
+    for (int d = 0; d < NUM_DIRECTIONS; d++)
+        writtenBy[d].assign(numTileTypes, -1);
+    for (int entryIndex = 0; entryIndex < (int)constraintEntries.size(); entryIndex++) {
+        const ConstraintEntry& entry = constraintEntries[entryIndex];
+        Direction d;
+        if (!parseDirection(entry.dirStr, d)) {
+            cerr << "Invalid direction in constraint: " << entry.dirStr << endl;
+            continue;
+        }
+        int baseTileID = findTile(entry.baseTileName);
+        if (baseTileID < 0) {
+            cerr << "Unknown tile name in constraints: " << entry.baseTileName << endl;
+            continue;
+        }
+        vector<int> allowedIDs;
+        for (const auto &allowedName : entry.allowedNames) {
+            int allowedID = findTile(allowedName);
+            if (allowedID < 0) {
+                cerr << "Unknown allowed tile name: " << allowedName << endl;
+                continue;
+            }
+            allowedIDs.push_back(allowedID);
+        }
+        int transforms = tileSymmetry[baseTileID] ? 8 : 1;
+        for (int g = 0; g < transforms; g++) {
+            bool mirrored = g >= 4;
+            int turns = g % 4;
+            // A left-right mirror swaps EAST and WEST; a turn moves each
+            // planar direction one step clockwise. UP and DOWN stay.
+            int dir = d;
+            if (d < UP) {
+                dir = mirrored ? (4 - d) % 4 : d;
+                dir = (dir + turns) % 4;
+            }
+            int tileID = transformTile(baseTileID, mirrored, turns);
+            vector<bool>& allowed = declared[dir][tileID];
+            // Clear default allowed list for the given direction.
+            if (writtenBy[dir][tileID] != entryIndex) {
+                allowed.assign(numTileTypes, false);
+                writtenBy[dir][tileID] = entryIndex;
+            }
+            for (int allowedID : allowedIDs)
+                allowed[transformTile(allowedID, mirrored, turns)] = true;
+        }
+    }
+    adjacency.compile(numTileTypes, declared);
+    for (const auto &def : tileDefinitions)
+        if (def.weight != tileDefinitions[0].weight)
+            uniformWeights = false;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Binary rule files, .wfcin output and rule learning from example tilemaps.
+static const char RULES_MAGIC[4] = { 'W', 'F', 'C', 'R' };
+static const char MAP_MAGIC[4] = { 'W', 'F', 'C', 'M' };
+static const uint32_t RULES_VERSION = 2;            // Version 1 files hold no UP and DOWN rows.
+static const char* const DIRECTION_NAMES[NUM_DIRECTIONS] = { "NORTH", "EAST", "SOUTH", "WEST", "UP", "DOWN" };
+
+// Whether a file starts with the given magic.
+static bool hasMagic(const string &filename, const char (&magic)[4]) {
+    ifstream infile(filename, ios::binary);
+    char head[4];
+    return infile.read(head, sizeof(head)) && memcmp(head, magic, sizeof(head)) == 0;
+}
+
+template <typename T>
+static bool readValue(istream &in, T &value) {
+    return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static void writeValue(ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+shared_ptr<const WFCRules> WFCRules::load(const string &filename) {
+    auto rules = make_shared<WFCRules>();
+    bool loaded = hasMagic(filename, RULES_MAGIC) ? rules->loadFromBinaryFile(filename)
+                                                  : rules->loadFromFile(filename);
+    if (!loaded)
+        return nullptr;
+    return rules;
+}
+
+bool WFCRules::loadFromBinaryFile(const string &filename) {
+    ifstream infile(filename, ios::binary);
+    if (!infile.is_open()) {
+        cerr << "Failed to open file: " << filename << endl;
+        return false;
+    }
+    char magic[4];
+    uint32_t version = 0, numTiles = 0;
+    if (!infile.read(magic, sizeof(magic)) || memcmp(magic, RULES_MAGIC, sizeof(magic)) != 0
+        || !readValue(infile, version) || version < 1 || version > RULES_VERSION
+        || !readValue(infile, numTiles) || numTiles == 0 || numTiles > 0xFFFF) {
+        cerr << "Not a binary rule file: " << filename << endl;
+        return false;
+    }
+    for (uint32_t t = 0; t < numTiles; t++) {
+        WFCTileDefinition def;
+        uint32_t nameLength = 0;
+        uint8_t color[3];
+        if (!readValue(infile, nameLength) || nameLength > 0xFFFF) {
+            cerr << "Invalid binary rule file: " << filename << endl;
+            return false;
+        }
+        def.name.resize(nameLength);
+        if (!infile.read(def.name.data(), nameLength) || !infile.read(reinterpret_cast<char*>(color), 3)
+            || !readValue(infile, def.weight) || !(def.weight > 0.0)) {
+            cerr << "Invalid binary rule file: " << filename << endl;
+            return false;
+        }
+        def.r = color[0];
+        def.g = color[1];
+        def.b = color[2];
+        def.weightLogWeight = def.weight * log(def.weight);
+        tileNameToID[def.name] = t;
+        tileDefinitions.push_back(def);
+        if (def.weight != tileDefinitions[0].weight)
+            uniformWeights = false;
+    }
+    adjacency.reset(numTiles);
+    int numDirections = version == 1 ? 4 : NUM_DIRECTIONS;
+    size_t rowBytes = (size_t)numDirections * numTiles * adjacency.numWords() * sizeof(uint64_t);
+    if (!infile.read(reinterpret_cast<char*>(adjacency.row(NORTH, 0)), rowBytes)) {
+        cerr << "Truncated binary rule file: " << filename << endl;
+        return false;
+    }
+    if (version == 1)
+        adjacency.allowAll(UP);
+    return true;
+}
+
+bool WFCRules::saveText(const string &filename) const {
+    ofstream out(filename);
+    if (!out.is_open()) {
+        cerr << "Failed to open file: " << filename << endl;
+        return false;
+    }
+    out.precision(17);
+    out << "[WFINPUT]\n[Tiles]\n";
+    for (const auto &def : tileDefinitions)
+        out << def.name << " " << def.r << " " << def.g << " " << def.b << " " << def.weight << "\n";
+    out << "[Constraints]\n";
+    int numTiles = tileDefinitions.size();
+    for (int t = 0; t < numTiles; t++) {
+        for (int d = 0; d < NUM_DIRECTIONS; d++) {
+            // Vertical lines that allow everything are the loader's default;
+            // leaving them out keeps the files of 2D rule sets as they were.
+            if (d >= UP && adjacency.countAllowed(static_cast<Direction>(d), t) == numTiles)
+                continue;
+            out << tileDefinitions[t].name << " " << DIRECTION_NAMES[d];
+            adjacency.forEachAllowed(static_cast<Direction>(d), t, [&](int n) {
+                out << " " << tileDefinitions[n].name;
+            });
+            out << "\n";
+        }
+    }
+    out.close();
+    if (!out) {
+        cerr << "Error writing file: " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool WFCRules::saveBinary(const string &filename) const {
+    ofstream out(filename, ios::binary);
+    if (!out.is_open()) {
+        cerr << "Failed to open file: " << filename << endl;
+        return false;
+    }
+    uint32_t numTiles = tileDefinitions.size();
+    out.write(RULES_MAGIC, sizeof(RULES_MAGIC));
+    writeValue(out, RULES_VERSION);
+    writeValue(out, numTiles);
+    for (const auto &def : tileDefinitions) {
+        uint8_t color[3] = { (uint8_t)def.r, (uint8_t)def.g, (uint8_t)def.b };
+        writeValue(out, (uint32_t)def.name.size());
+        out.write(def.name.data(), def.name.size());
+        out.write(reinterpret_cast<const char*>(color), 3);
+        writeValue(out, def.weight);
+    }
+    out.write(reinterpret_cast<const char*>(adjacency.row(NORTH, 0)),
+              (size_t)NUM_DIRECTIONS * numTiles * adjacency.numWords() * sizeof(uint64_t));
+    out.close();
+    if (!out) {
+        cerr << "Error writing file: " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+WFCRuleLearner::WFCRuleLearner(shared_ptr<const WFCRules> tileSet) : fixedTiles(tileSet != nullptr) {
+    if (tileSet) {
+        for (const auto &def : tileSet->tileDefinitions) {
+            tileIDs[def.name] = tiles.size();
+            tiles.push_back(def);
+            tiles.back().weight = 0.0;
+        }
+        for (auto &rows : seen)
+            rows.resize(tiles.size());
+    }
+}
+
+int WFCRuleLearner::tileID(const string &name) {
+    auto found = tileIDs.find(name);
+    if (found != tileIDs.end())
+        return found->second;
+    if (fixedTiles)
+        return -1;
+    // New tiles get a color derived from their name (FNV-1a), so a tile
+    // keeps its color from one run to the next.
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : name)
+        h = (h ^ c) * 0x100000001b3ull;
+    h = WFCRandom::mix(h);
+    WFCTileDefinition def;
+    def.name = name;
+    def.r = h & 0xFF;
+    def.g = (h >> 8) & 0xFF;
+    def.b = (h >> 16) & 0xFF;
+    def.weight = 0.0;
+    tileIDs.emplace(name, tiles.size());
+    tiles.push_back(def);
+    for (auto &rows : seen)
+        rows.emplace_back();
+    return tiles.size() - 1;
+}
+
+void WFCRuleLearner::observe(int dir, int tileID, int neighborID) {
+    vector<uint64_t> &bits = seen[dir][tileID];
+    size_t word = neighborID >> 6;
+    if (word >= bits.size())
+        bits.resize(word + 1, 0);
+    bits[word] |= 1ull << (neighborID & 63);
+}
+
+bool WFCRuleLearner::addRow(bool continuesMap, const string &source) {
+    if (continuesMap && currentRow.size() != previousRow.size()) {
+        cerr << "Rows of different widths in " << source << endl;
+        return false;
+    }
+    for (size_t x = 0; x < currentRow.size(); x++) {
+        tiles[currentRow[x]].weight += 1.0;
+        if (x > 0)
+            observe(0, currentRow[x - 1], currentRow[x]);
+        if (continuesMap)
+            observe(1, previousRow[x], currentRow[x]);
+    }
+    swap(previousRow, currentRow);
+    return true;
+}
+
+bool WFCRuleLearner::addTextMaps(istream &in, const string &source) {
+    string line, name;
+    bool inMap = false;
+    while (getline(in, line)) {
+        if (!line.empty() && line[0] == '#')
+            continue;
+        currentRow.clear();
+        for (size_t i = 0; i < line.size();) {
+            if (isspace(static_cast<unsigned char>(line[i]))) {
+                i++;
+                continue;
+            }
+            size_t end = i;
+            while (end < line.size() && !isspace(static_cast<unsigned char>(line[end])))
+                end++;
+            name.assign(line, i, end - i);
+            int id = tileID(name);
+            if (id < 0) {
+                cerr << "Unknown tile name in " << source << ": " << name << endl;
+                return false;
+            }
+            currentRow.push_back(id);
+            i = end;
+        }
+        if (currentRow.empty()) {
+            inMap = false;
+            continue;
+        }
+        if (!addRow(inMap, source))
+            return false;
+        inMap = true;
+    }
+    return true;
+}
+
+bool WFCRuleLearner::addBinaryMaps(istream &in, const string &source) {
+    vector<int> idToTile;  // Tile of each binary ID seen so far, or -1.
+    vector<unsigned char> bytes;
+    char magic[4];
+    while (in.read(magic, sizeof(magic))) {
+        uint32_t width = 0, height = 0, cellBytes = 0;
+        if (memcmp(magic, MAP_MAGIC, sizeof(magic)) != 0 || !readValue(in, width) || !readValue(in, height)
+            || !readValue(in, cellBytes) || (cellBytes != 1 && cellBytes != 2 && cellBytes != 4)) {
+            cerr << "Invalid binary map in " << source << endl;
+            return false;
+        }
+        bytes.resize((size_t)width * cellBytes);
+        for (uint32_t y = 0; y < height; y++) {
+            if (!in.read(reinterpret_cast<char*>(bytes.data()), bytes.size())) {
+                cerr << "Truncated binary map in " << source << endl;
+                return false;
+            }
+            currentRow.resize(width);
+            for (uint32_t x = 0; x < width; x++) {
+                uint32_t id;
+                if (cellBytes == 1) {
+                    id = bytes[x];
+                } else if (cellBytes == 2) {
+                    uint16_t v;
+                    memcpy(&v, &bytes[x * 2], sizeof(v));
+                    id = v;
+                } else {
+                    memcpy(&id, &bytes[x * 4], sizeof(id));
+                }
+                if (id >= idToTile.size()) {
+                    if (id > 0xFFFF) {
+                        cerr << "Tile ID out of range in " << source << ": " << id << endl;
+                        return false;
+                    }
+                    idToTile.resize(id + 1, -1);
+                }
+                if (idToTile[id] < 0) {
+                    idToTile[id] = fixedTiles ? (id < tiles.size() ? (int)id : -1) : tileID("tile" + to_string(id));
+                    if (idToTile[id] < 0) {
+                        cerr << "Tile ID not in the tile set in " << source << ": " << id << endl;
+                        return false;
+                    }
+                }
+                currentRow[x] = idToTile[id];
+            }
+            if (!addRow(y > 0, source))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool WFCRuleLearner::addFile(const string &filename) {
+    ifstream infile(filename, ios::binary);
+    if (!infile.is_open()) {
+        cerr << "Failed to open file: " << filename << endl;
+        return false;
+    }
+    if (hasMagic(filename, MAP_MAGIC))
+        return addBinaryMaps(infile, filename);
+    return addTextMaps(infile, filename);
+}
+
+shared_ptr<const WFCRules> WFCRuleLearner::rules() const {
+    auto rules = make_shared<WFCRules>();
+    vector<int> learnedID(tiles.size(), -1);
+    for (size_t t = 0; t < tiles.size(); t++) {
+        if (!(tiles[t].weight > 0.0))
+            continue;
+        WFCTileDefinition def = tiles[t];
+        def.weightLogWeight = def.weight * log(def.weight);
+        learnedID[t] = rules->tileDefinitions.size();
+        rules->tileNameToID[def.name] = learnedID[t];
+        rules->tileDefinitions.push_back(def);
+        if (def.weight != rules->tileDefinitions[0].weight)
+            rules->uniformWeights = false;
+    }
+    if (rules->tileDefinitions.empty()) {
+        cerr << "No tiles were seen in the examples." << endl;
+        return nullptr;
+    }
+    rules->adjacency.reset(rules->tileDefinitions.size());
+    rules->adjacency.allowAll(UP);
+    for (int d = 0; d < 2; d++) {
+        Direction dir = d == 0 ? EAST : SOUTH;
+        for (size_t t = 0; t < tiles.size(); t++) {
+            if (learnedID[t] < 0)
+                continue;
+            const vector<uint64_t> &bits = seen[d][t];
+            for (size_t w = 0; w < bits.size(); w++)
+                for (uint64_t b = bits[w]; b; b &= b - 1)
+                    rules->adjacency.allow(dir, learnedID[t], learnedID[w * 64 + countr_zero(b)]);
+        }
+    }
+    return rules;
+}
+
+//------------------------------------------------------------------------------
+// Overlapping model: sample loading, pattern extraction and adjacency.
+bool WFCSample::load(const string &filename) {
+    ifstream infile(filename, ios::binary);
+    if (!infile.is_open()) {
+        cerr << "Failed to open file: " << filename << endl;
+        return false;
+    }
+    // Header fields are separated by whitespace; '#' starts a comment that
+    // runs to the end of the line. The whitespace after the last field is
+    // consumed, so binary pixels start right after it.
+    auto readField = [&](string& field) {
+        field.clear();
+        char c;
+        while (infile.get(c)) {
+            if (c == '#') {
+                string comment;
+                getline(infile, comment);
+                if (!field.empty())
+                    return true;
+            } else if (isspace(static_cast<unsigned char>(c))) {
+                if (!field.empty())
+                    return true;
+            } else {
+                field += c;
+            }
+        }
+        return !field.empty();
+    };
+    string magic, w, h, maxv;
+    if (!readField(magic) || (magic != "P6" && magic != "P3") || !readField(w) || !readField(h) || !readField(maxv)) {
+        cerr << "Not a PPM image: " << filename << endl;
+        return false;
+    }
+    width = atoi(w.c_str());
+    height = atoi(h.c_str());
+    int maxValue = atoi(maxv.c_str());
+    if (width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 255) {
+        cerr << "Unsupported PPM image: " << filename << endl;
+        return false;
+    }
+    size_t numValues = (size_t)width * height * 3;
+    vector<unsigned char> values(numValues);
+    if (magic == "P6") {
+        infile.read(reinterpret_cast<char*>(values.data()), numValues);
+        if ((size_t)infile.gcount() != numValues) {
+            cerr << "Truncated PPM image: " << filename << endl;
+            return false;
+        }
+    } else {
+        string field;
+        for (size_t i = 0; i < numValues; i++) {
+            if (!readField(field)) {
+                cerr << "Truncated PPM image: " << filename << endl;
+                return false;
+            }
+            values[i] = min(atoi(field.c_str()), maxValue);
+        }
+    }
+    pixels.resize((size_t)width * height);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        uint32_t r = values[i * 3] * 255 / maxValue;
+        uint32_t g = values[i * 3 + 1] * 255 / maxValue;
+        uint32_t b = values[i * 3 + 2] * 255 / maxValue;
+        pixels[i] = (r << 16) | (g << 8) | b;
+    }
+    return true;
+}
+
+// Mirrors a sample left to right.
+static WFCSample reflectSample(const WFCSample& in) {
+    WFCSample out;
+    out.width = in.width;
+    out.height = in.height;
+    out.pixels.resize(in.pixels.size());
+    for (int y = 0; y < in.height; y++)
+        for (int x = 0; x < in.width; x++)
+            out.pixels[(size_t)y * out.width + x] = in.pixels[(size_t)y * in.width + in.width - 1 - x];
+    return out;
+}
+
+// Rotates a sample by 90 degrees.
+static WFCSample rotateSample(const WFCSample& in) {
+    WFCSample out;
+    out.width = in.height;
+    out.height = in.width;
+    out.pixels.resize(in.pixels.size());
+    for (int y = 0; y < out.height; y++)
+        for (int x = 0; x < out.width; x++)
+            out.pixels[(size_t)y * out.width + x] = in.pixels[(size_t)x * in.width + in.width - 1 - y];
+    return out;
+}
+
+// WFCPatternTable: The distinct n x n blocks of the samples and their counts,
+// in order of first occurrence. Blocks are looked up by a 64-bit hash in an
+// open-addressing table and compared pixel by pixel only when the hashes are
+// equal, so extraction costs one probe per sample position.
+class WFCPatternTable {
+private:
+    int n;
+    vector<uint32_t> pixels;        // [pattern][row][column]
+    vector<double> counts;          // [pattern] occurrences.
+    vector<uint64_t> slotHashes;
+    vector<int> slotPatterns;       // Pattern in each slot, or -1 if the slot is free.
+    size_t mask;
+
+    bool matches(int pattern, const WFCSample& image, int x, int y) const {
+        const uint32_t* p = &pixels[(size_t)pattern * n * n];
+        for (int j = 0; j < n; j++) {
+            const uint32_t* row = &image.pixels[(size_t)(y + j) * image.width + x];
+            for (int i = 0; i < n; i++, p++)
+                if (*p != row[i])
+                    return false;
+        }
+        return true;
+    }
+
+    void grow() {
+        vector<uint64_t> oldHashes = move(slotHashes);
+        vector<int> oldPatterns = move(slotPatterns);
+        slotHashes.assign(oldHashes.size() * 2, 0);
+        slotPatterns.assign(oldPatterns.size() * 2, -1);
+        mask = slotPatterns.size() - 1;
+        for (size_t i = 0; i < oldPatterns.size(); i++) {
+            if (oldPatterns[i] < 0)
+                continue;
+            size_t slot = WFCRandom::mix(oldHashes[i]) & mask;
+            while (slotPatterns[slot] >= 0)
+                slot = (slot + 1) & mask;
+            slotHashes[slot] = oldHashes[i];
+            slotPatterns[slot] = oldPatterns[i];
+        }
+    }
+
+public:
+    explicit WFCPatternTable(int patternSize)
+        : n(patternSize), slotHashes(1024, 0), slotPatterns(1024, -1), mask(1023) {}
+
+    int size() const { return counts.size(); }
+    double count(int pattern) const { return counts[pattern]; }
+    const uint32_t* pattern(int pattern) const { return &pixels[(size_t)pattern * n * n]; }
+
+    // Counts one occurrence of the block of image whose top-left pixel is
+    // (x, y) and whose hash is h. Returns its pattern.
+    int add(const WFCSample& image, int x, int y, uint64_t h) {
+        size_t slot = WFCRandom::mix(h) & mask;
+        for (; slotPatterns[slot] >= 0; slot = (slot + 1) & mask) {
+            int pattern = slotPatterns[slot];
+            if (slotHashes[slot] == h && matches(pattern, image, x, y)) {
+                counts[pattern] += 1.0;
+                return pattern;
+            }
+        }
+        slotHashes[slot] = h;
+        slotPatterns[slot] = counts.size();
+        counts.push_back(1.0);
+        for (int j = 0; j < n; j++) {
+            const uint32_t* row = &image.pixels[(size_t)(y + j) * image.width + x];
+            pixels.insert(pixels.end(), row, row + n);
+        }
+        if (counts.size() * 2 > slotPatterns.size())
+            grow();
+        return counts.size() - 1;
+    }
+
+    // Adds every n x n block of image. Block hashes are polynomial hashes
+    // rolled along each row and then down each column, so each one costs
+    // O(1) instead of O(n * n). Neighboring blocks are often the same in
+    // flat areas of a sample, so a block equal to the one left of it skips
+    // the table lookup.
+    void addAll(const WFCSample& image) {
+        const uint64_t ROW_BASE = 0x100000001b3ull, COLUMN_BASE = 0x9e3779b97f4a7c15ull;
+        int cols = image.width - n + 1, rows = image.height - n + 1;
+        if (cols <= 0 || rows <= 0)
+            return;
+        uint64_t rowPower = 1, columnPower = 1;  // ROW_BASE^n and COLUMN_BASE^n.
+        for (int i = 0; i < n; i++) {
+            rowPower *= ROW_BASE;
+            columnPower *= COLUMN_BASE;
+        }
+        // rowHashes[y][x]: hash of the n pixels of row y starting at column x.
+        vector<uint64_t> rowHashes((size_t)image.height * cols);
+        for (int y = 0; y < image.height; y++) {
+            const uint32_t* p = &image.pixels[(size_t)y * image.width];
+            uint64_t* out = &rowHashes[(size_t)y * cols];
+            uint64_t h = 0;
+            for (int i = 0; i < n; i++)
+                h = h * ROW_BASE + p[i] + 1;
+            out[0] = h;
+            for (int x = 1; x < cols; x++) {
+                h = h * ROW_BASE + p[x + n - 1] + 1 - (p[x - 1] + 1) * rowPower;
+                out[x] = h;
+            }
+        }
+        // blockHashes[x]: hash of the block at (x, y), rolled down from y - 1.
+        vector<uint64_t> blockHashes(cols, 0);
+        for (int j = 0; j < n; j++)
+            for (int x = 0; x < cols; x++)
+                blockHashes[x] = blockHashes[x] * COLUMN_BASE + rowHashes[(size_t)j * cols + x];
+        for (int y = 0; y < rows; y++) {
+            if (y > 0) {
+                const uint64_t* entering = &rowHashes[(size_t)(y + n - 1) * cols];
+                const uint64_t* leaving = &rowHashes[(size_t)(y - 1) * cols];
+                for (int x = 0; x < cols; x++)
+                    blockHashes[x] = blockHashes[x] * COLUMN_BASE + entering[x] - leaving[x] * columnPower;
+            }
+            int last = -1;
+            for (int x = 0; x < cols; x++) {
+                if (last >= 0 && blockHashes[x] == blockHashes[x - 1] && matches(last, image, x, y))
+                    counts[last] += 1.0;
+                else
+                    last = add(image, x, y, blockHashes[x]);
+            }
+        }
+    }
+};
+
+shared_ptr<const WFCRules> WFCRules::fromSample(const WFCSample& sample, int patternSize, int symmetry) {
+    int n = patternSize;
+    if (n < 1 || sample.width < n || sample.height < n) {
+        cerr << "Sample is smaller than one " << n << "x" << n << " pattern." << endl;
+        return nullptr;
+    }
+    // Variants in the order original, mirrored, rotated, rotated and
+    // mirrored, ..., of which the first symmetry are used.
+    WFCPatternTable table(n);
+    WFCSample rotated = sample;
+    for (int variant = 0; variant < clamp(symmetry, 1, 8); variant++) {
+        if (variant % 2 == 0) {
+            if (variant > 0)
+                rotated = rotateSample(rotated);
+            table.addAll(rotated);
+        } else {
+            table.addAll(reflectSample(rotated));
+        }
+    }
+
+    // The adjacency matrix takes one bit per pair of patterns in each of the
+    // six directions, 0.75 * numPatterns^2 bytes.
+    const int MAX_PATTERNS = 1 << 15;
+    int numPatterns = table.size();
+    if (numPatterns > MAX_PATTERNS) {
+        cerr << "Sample has " << numPatterns << " distinct patterns, more than " << MAX_PATTERNS
+             << "; use a smaller pattern size or symmetry." << endl;
+        return nullptr;
+    }
+    auto rules = make_shared<WFCRules>();
+    for (int p = 0; p < numPatterns; p++) {
+        WFCTileDefinition def;
+        def.name = "pattern" + to_string(p);
+        uint32_t color = table.pattern(p)[0];
+        def.r = (color >> 16) & 0xFF;
+        def.g = (color >> 8) & 0xFF;
+        def.b = color & 0xFF;
+        def.weight = table.count(p);
+        def.weightLogWeight = def.weight * log(def.weight);
+        rules->tileNameToID[def.name] = p;
+        rules->tileDefinitions.push_back(def);
+        if (def.weight != rules->tileDefinitions[0].weight)
+            rules->uniformWeights = false;
+    }
+
+    // b may be placed east of a when a's block without its first column
+    // equals b's block without its last column, and south of a likewise for
+    // rows. Rather than comparing every pair, both overlaps of every pattern
+    // are hashed and sorted, and only patterns with equal hashes compared.
+    rules->adjacency.reset(numPatterns);
+    rules->adjacency.allowAll(UP);
+    for (Direction dir : { EAST, SOUTH }) {
+        int shiftX = dir == EAST, shiftY = dir == SOUTH;
+        int w = n - shiftX, h = n - shiftY;
+        auto overlapHash = [&](int p, int x0, int y0) {
+            uint64_t hash = 0;
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                    hash = hash * 0x100000001b3ull + table.pattern(p)[(y0 + y) * n + x0 + x] + 1;
+            return hash;
+        };
+        auto overlapsMatch = [&](int a, int b) {
+            for (int y = 0; y < h; y++)
+                if (memcmp(&table.pattern(a)[(shiftY + y) * n + shiftX], &table.pattern(b)[y * n],
+                           w * sizeof(uint32_t)) != 0)
+                    return false;
+            return true;
+        };
+        vector<pair<uint64_t, int>> leading(numPatterns), trailing(numPatterns);
+        for (int p = 0; p < numPatterns; p++) {
+            leading[p] = { overlapHash(p, shiftX, shiftY), p };
+            trailing[p] = { overlapHash(p, 0, 0), p };
+        }
+        sort(leading.begin(), leading.end());
+        sort(trailing.begin(), trailing.end());
+        size_t i = 0, j = 0;
+        while (i < leading.size() && j < trailing.size()) {
+            if (leading[i].first < trailing[j].first) {
+                i++;
+            } else if (trailing[j].first < leading[i].first) {
+                j++;
+            } else {
+                uint64_t hash = leading[i].first;
+                size_t jEnd = j;
+                while (jEnd < trailing.size() && trailing[jEnd].first == hash)
+                    jEnd++;
+                for (; i < leading.size() && leading[i].first == hash; i++)
+                    for (size_t k = j; k < jEnd; k++)
+                        if (overlapsMatch(leading[i].second, trailing[k].second))
+                            rules->adjacency.allow(dir, leading[i].second, trailing[k].second);
+                j = jEnd;
+            }
+        }
+    }
+    return rules;
+}
+
+//------------------------------------------------------------------------------
+// WFCTopology: Grid generators and mesh loading.
+void WFCTopology::endCell(double x, double y) {
+    edgeStart.push_back(edgeTarget.size());
+    positionX.push_back(x);
+    positionY.push_back(y);
+}
+
+void WFCTopology::finish() {
+    double maxX = 0.0, maxY = 0.0;
+    for (int cell = 0; cell < numCells(); cell++) {
+        maxX = max(maxX, positionX[cell]);
+        maxY = max(maxY, positionY[cell]);
+        unsigned seen = 0;
+        for (int e = edgeStart[cell]; e < edgeStart[cell + 1]; e++) {
+            bandwidth = max(bandwidth, abs(edgeTarget[e] - cell));
+            if ((seen >> edgeDirection[e]) & 1)
+                uniqueDirections = false;
+            seen |= 1u << edgeDirection[e];
+        }
+    }
+    columns = (int)ceil(maxX + 1.0);
+    rows = (int)ceil(maxY + 1.0);
+}
+
+shared_ptr<const WFCTopology> WFCTopology::square(int w, int h) {
+    auto topology = make_shared<WFCTopology>();
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int cell = y * w + x;
+            if (y > 0)     topology->addEdge(cell - w, NORTH);
+            if (x + 1 < w) topology->addEdge(cell + 1, EAST);
+            if (y + 1 < h) topology->addEdge(cell + w, SOUTH);
+            if (x > 0)     topology->addEdge(cell - 1, WEST);
+            topology->endCell(x, y);
+        }
+    }
+    topology->finish();
+    return topology;
+}
+
+shared_ptr<const WFCTopology> WFCTopology::hex(int w, int h) {
+    auto topology = make_shared<WFCTopology>();
+    for (int y = 0; y < h; y++) {
+        // The diagonal neighbors of an odd row are half a hex further east.
+        int shift = y & 1;
+        for (int x = 0; x < w; x++) {
+            int cell = y * w + x;
+            int westColumn = x - 1 + shift, eastColumn = x + shift;
+            if (y > 0 && eastColumn < w)      topology->addEdge(cell - w - x + eastColumn, NORTHEAST);
+            if (x + 1 < w)                    topology->addEdge(cell + 1, EAST);
+            if (y + 1 < h && westColumn >= 0) topology->addEdge(cell + w - x + westColumn, SOUTHWEST);
+            if (x > 0)                        topology->addEdge(cell - 1, WEST);
+            if (y > 0 && westColumn >= 0)     topology->addEdge(cell - w - x + westColumn, NORTHWEST);
+            if (y + 1 < h && eastColumn < w)  topology->addEdge(cell + w - x + eastColumn, SOUTHEAST);
+            topology->endCell(x + 0.5 * shift, y);
+        }
+    }
+    topology->finish();
+    return topology;
+}
+
+shared_ptr<const WFCTopology> WFCTopology::triangle(int w, int h) {
+    auto topology = make_shared<WFCTopology>();
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int cell = y * w + x;
+            bool up = (x + y) % 2 == 0;
+            if (!up && y > 0)    topology->addEdge(cell - w, NORTH);
+            if (x + 1 < w)       topology->addEdge(cell + 1, EAST);
+            if (up && y + 1 < h) topology->addEdge(cell + w, SOUTH);
+            if (x > 0)           topology->addEdge(cell - 1, WEST);
+            topology->endCell(x, y);
+        }
+    }
+    topology->finish();
+    return topology;
+}
+
+shared_ptr<const WFCTopology> WFCTopology::loadMesh(const string& filename, int directions) {
+    if (directions != 4 && directions != 6) {
+        cerr << "A mesh has 4 or 6 directions, not " << directions << "." << endl;
+        return nullptr;
+    }
+    ifstream in(filename);
+    if (!in) {
+        cerr << "Could not open mesh file: " << filename << endl;
+        return nullptr;
+    }
+    vector<double> vertexX, vertexY, centroidX, centroidY;
+    vector<tuple<int, int, int>> faceEdges;    // (lower vertex, higher vertex, face) of every side of a face.
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string keyword;
+        fields >> keyword;
+        if (keyword == "v") {
+            double x = 0.0, y = 0.0;
+            fields >> x >> y;
+            vertexX.push_back(x);
+            vertexY.push_back(y);
+        } else if (keyword == "f") {
+            // Corners are v, v/vt, v//vn or v/vt/vn, 1-based or negative
+            // counting back from the last vertex.
+            vector<int> corners;
+            string corner;
+            while (fields >> corner) {
+                int v = atoi(corner.c_str());
+                v = v < 0 ? (int)vertexX.size() + v : v - 1;
+                if (v < 0 || v >= (int)vertexX.size()) {
+                    cerr << "Invalid vertex " << corner << " in mesh file: " << filename << endl;
+                    return nullptr;
+                }
+                corners.push_back(v);
+            }
+            if (corners.size() < 3)
+                continue;
+            int face = centroidX.size();
+            double x = 0.0, y = 0.0;
+            for (size_t i = 0; i < corners.size(); i++) {
+                int a = corners[i], b = corners[(i + 1) % corners.size()];
+                faceEdges.emplace_back(min(a, b), max(a, b), face);
+                x += vertexX[a];
+                y += vertexY[a];
+            }
+            centroidX.push_back(x / corners.size());
+            centroidY.push_back(y / corners.size());
+        }
+    }
+    int numFaces = centroidX.size();
+    if (numFaces == 0) {
+        cerr << "Mesh file has no faces: " << filename << endl;
+        return nullptr;
+    }
+
+    // Once sorted, the faces sharing a side are next to each other.
+    sort(faceEdges.begin(), faceEdges.end());
+    vector<pair<int, int>> links;
+    for (size_t i = 0, j; i < faceEdges.size(); i = j) {
+        for (j = i + 1; j < faceEdges.size() && get<0>(faceEdges[j]) == get<0>(faceEdges[i])
+                                             && get<1>(faceEdges[j]) == get<1>(faceEdges[i]); j++)
+            for (size_t k = i; k < j; k++)
+                if (get<2>(faceEdges[k]) != get<2>(faceEdges[j]))
+                    links.emplace_back(get<2>(faceEdges[k]), get<2>(faceEdges[j]));
+    }
+    sort(links.begin(), links.end());
+    links.erase(unique(links.begin(), links.end()), links.end());
+
+    // Positions: linked centroids about one tile apart, y pointing down.
+    double distance = 0.0;
+    for (auto [a, b] : links)
+        distance += hypot(centroidX[b] - centroidX[a], centroidY[b] - centroidY[a]);
+    double scale = distance > 0.0 ? links.size() / distance : 1.0;
+    double minX = *min_element(centroidX.begin(), centroidX.end());
+    double maxY = *max_element(centroidY.begin(), centroidY.end());
+    vector<double> x(numFaces), y(numFaces);
+    for (int face = 0; face < numFaces; face++) {
+        x[face] = (centroidX[face] - minX) * scale;
+        y[face] = (maxY - centroidY[face]) * scale;
+    }
+
+    // Number the faces in rows, west to east, so that linked cells are
+    // close in memory like on a grid.
+    vector<int> order(numFaces), cellOf(numFaces);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        double rowA = floor(y[a] + 0.5), rowB = floor(y[b] + 0.5);
+        return rowA != rowB ? rowA < rowB : x[a] < x[b];
+    });
+    for (int cell = 0; cell < numFaces; cell++)
+        cellOf[order[cell]] = cell;
+
+    // The direction of a link is computed once, so its reverse edge always
+    // gets the opposite one. Sectors are counterclockwise from EAST.
+    static const Direction SECTORS_4[4] = { EAST, NORTH, WEST, SOUTH };
+    static const Direction SECTORS_6[6] = { EAST, NORTHEAST, NORTHWEST, WEST, SOUTHWEST, SOUTHEAST };
+    vector<vector<pair<Direction, int>>> edges(numFaces);   // [cell] (direction, target cell).
+    for (auto [a, b] : links) {
+        double turns = atan2(centroidY[b] - centroidY[a], centroidX[b] - centroidX[a]) / (2.0 * numbers::pi);
+        int sector = ((int)floor(turns * directions + 0.5) % directions + directions) % directions;
+        Direction dir = directions == 4 ? SECTORS_4[sector] : SECTORS_6[sector];
+        edges[cellOf[a]].emplace_back(dir, cellOf[b]);
+        edges[cellOf[b]].emplace_back(opposite(dir), cellOf[a]);
+    }
+    auto topology = make_shared<WFCTopology>();
+    for (int cell = 0; cell < numFaces; cell++) {
+        sort(edges[cell].begin(), edges[cell].end());
+        for (auto [dir, target] : edges[cell])
+            topology->addEdge(target, dir);
+        topology->endCell(x[order[cell]], y[order[cell]]);
+    }
+    topology->finish();
+    return topology;
+}
+
+//------------------------------------------------------------------------------
+// Propagator and domain width names.
+bool parsePropagatorMode(const string& name, PropagatorMode &mode) {
+    if (name == "bitset") { mode = PROPAGATE_BITSET; return true; }
+    if (name == "ac4")    { mode = PROPAGATE_AC4;    return true; }
+    return false;
+}
+
+DomainWidth narrowestDomainWidth(int numTiles) {
+    if (numTiles <= 8)  return DOMAIN_8;
+    if (numTiles <= 16) return DOMAIN_16;
+    if (numTiles <= 32) return DOMAIN_32;
+    if (numTiles <= 64) return DOMAIN_64;
+    return DOMAIN_WIDE;
+}
+
+string domainWidthName(DomainWidth width) {
+    if (width == DOMAIN_AUTO) return "auto";
+    if (width == DOMAIN_WIDE) return "wide";
+    return to_string(static_cast<int>(width));
+}
+
+bool parseDomainWidth(const string& name, DomainWidth &width) {
+    for (DomainWidth w : { DOMAIN_AUTO, DOMAIN_8, DOMAIN_16, DOMAIN_32, DOMAIN_64, DOMAIN_WIDE })
+        if (name == domainWidthName(w)) { width = w; return true; }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// WFC: Grid state shared by every domain width, and image output.
+void WFC::snapWeights() {
+    // Rounds the values to multiples of 2^-k, with k such that the sum of
+    // their magnitudes is below 2^51 of those units. Every sum or difference
+    // of them is then a whole number of units that a double holds exactly.
+    // Returns the unit.
+    auto snap = [](vector<double>& values) {
+        double total = 0.0;
+        for (double v : values)
+            total += fabs(v);
+        int exponent;
+        frexp(max(total, 1.0), &exponent);
+        int k = 51 - exponent;
+        for (double& v : values)
+            v = ldexp(round(ldexp(v, k)), -k);
+        return ldexp(1.0, -k);
+    };
+    weights.clear();
+    weightLogWeights.clear();
+    for (const auto &def : tileDefinitions) {
+        weights.push_back(def.weight);
+        weightLogWeights.push_back(def.weightLogWeight);
+    }
+    // A weight far below the others still keeps its tile possible.
+    double unit = snap(weights);
+    for (double& w : weights)
+        w = max(w, unit);
+    snap(weightLogWeights);
+}
+
+void WFC::resetGrid(int w, int h, int d, uint64_t solverSeed) {
+    seed = solverSeed;
+    rng = WFCRandom(solverSeed);
+    if (layout == LAYOUT_GRAPH) {
+        w = topology->numCells();
+        h = d = 1;
+    }
+    // A dimension below 1 gives an empty grid, which is complete from the start.
+    w = max(0, w);
+    h = max(0, h);
+    d = max(0, d);
+    width = w;
+    height = h;
+    depth = d;
+    if (layout == LAYOUT_VOLUME) {
+        bricksX = (w + 3) / 4;
+        bricksY = (h + 3) / 4;
+        bricksZ = (d + 3) / 4;
+        numCells = bricksX * bricksY * bricksZ * 64;
+    } else {
+        numCells = w * h;
+    }
+    uncollapsedCells = w * h * d;
+    contradiction = false;
+    backtracks = 0;
+
+    int numTileTypes = tileDefinitions.size();
+    double totalWeight = 0.0, totalWeightLogWeight = 0.0;
+    for (int t = 0; t < numTileTypes; t++) {
+        totalWeight += weights[t];
+        totalWeightLogWeight += weightLogWeights[t];
+    }
+    for (int dir = 0; dir < 4; dir++)
+        neighborOffset[dir] = dy[dir] * width + dx[dir];
+
+    collapsedFlags.assign(numCells, 0);
+    finalTiles.reset(numCells, numTileTypes);
+    sumWeights.assign(numCells, totalWeight);
+    sumWeightLogWeights.assign(numCells, totalWeightLogWeight);
+    queued.assign(numCells, 0);
+    cellHeap.reset(numCells, numCells > 0 ? entropy(0) : 0.0);
+    worklist.clear();
+    removals.clear();
+    trail.clear();
+    decisions.clear();
+
+    if (layout == LAYOUT_VOLUME) {
+        neighborMasks.assign(numCells, PADDING_CELL);
+        for (int z = 0; z < d; z++)
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                    neighborMasks[cellIndex(x, y, z)] = (y > 0) << NORTH | (x + 1 < w) << EAST
+                                                      | (y + 1 < h) << SOUTH | (x > 0) << WEST
+                                                      | (z + 1 < d) << UP | (z > 0) << DOWN;
+        for (int cell = 0; cell < numCells; cell++) {
+            if (neighborMasks[cell] == PADDING_CELL) {
+                collapsedFlags[cell] = 1;
+                cellHeap.remove(cell);
+            }
+        }
+    } else if (layout == LAYOUT_GRAPH) {
+        neighborMasks.assign(numCells, 0);
+        for (int cell = 0; cell < numCells; cell++)
+            for (int e = topology->edgeStart[cell]; e < topology->edgeStart[cell + 1]; e++)
+                neighborMasks[cell] |= 1 << topology->edgeDirection[e];
+    }
+}
+
+void WFC::imageSize(int& imageWidth, int& imageHeight) const {
+    if (layout == LAYOUT_GRAPH) {
+        imageWidth = topology->columns * tileSize;
+        imageHeight = topology->rows * tileSize;
+    } else {
+        imageWidth = width * tileSize;
+        imageHeight = height * depth * tileSize;
+    }
+}
+
+void WFC::generateImage(const string& filename) {
+    vector<unsigned char> image;
+    renderImage(image);
+    int imageWidth, imageHeight;
+    imageSize(imageWidth, imageHeight);
+    int channels = 3; // RGB
+    if (stbi_write_png(filename.c_str(), imageWidth, imageHeight, channels, image.data(), imageWidth * channels))
+        cout << "Image generated: " << filename << endl;
+    else
+        cerr << "Error writing image file." << endl;
+}
+
+void WFC::renderImage(vector<unsigned char>& image) const {
+    int imageWidth, imageHeight;
+    imageSize(imageWidth, imageHeight);
+    int channels = 3; // RGB
+
+    image.assign((size_t)imageWidth * imageHeight * channels, 255);
+    // Fills the tile-sized square at pixel (left, top) with a cell's color.
+    auto drawCell = [&](int cell, int left, int top) {
+        int tileID = finalTiles.get(cell);
+        int r = 200, g = 200, b = 200;
+        if (tileID >= 0 && tileID < (int)tileDefinitions.size()) {
+            r = tileDefinitions[tileID].r;
+            g = tileDefinitions[tileID].g;
+            b = tileDefinitions[tileID].b;
+        }
+        for (int ty = 0; ty < tileSize; ty++) {
+            int py = top + ty;
+            for (int tx = 0; tx < tileSize; tx++) {
+                int px = left + tx;
+                size_t index = ((size_t)py * imageWidth + px) * channels;
+                image[index+0] = r;
+                image[index+1] = g;
+                image[index+2] = b;
+            }
+        }
+    };
+    if (layout == LAYOUT_GRAPH) {
+        for (int cell = 0; cell < numCells; cell++)
+            drawCell(cell, (int)lround(topology->positionX[cell] * tileSize),
+                     (int)lround(topology->positionY[cell] * tileSize));
+        return;
+    }
+    // Rows of the image run through the z layers: image row y is layer
+    // y / height.
+    for (int y = 0; y < height * depth; y++)
+        for (int x = 0; x < width; x++)
+            drawCell(cellIndex(x, y % height, y / height), x * tileSize, y * tileSize);
+}
+
+//------------------------------------------------------------------------------
+// Layouts the solver core is instantiated for.
+//   WFCPlanarLayout: w x h grid, cell = y * width + x, four directions whose
+//     neighbors sit at constant offsets.
+//   WFCVolumeLayout: w x h x d volume in 4 x 4 x 4 bricks (see WFC), six
+//     directions, neighbor existence read from neighborMasks.
+//   WFCGraphLayout: cells and edges of a WFCTopology, neighbors read from
+//     its edge arrays with the direction of each edge.
+// A layer is the unit parallel propagation splits the grid into: a row of a
+// plane, a layer of bricks (four z slices) of a volume, or bandwidth
+// consecutive cells of a graph, so that edges only link neighboring layers.
+struct WFCPlanarLayout {
+    static constexpr int DIRECTIONS = 4;
+    static constexpr int MIN_REGION_LAYERS = 16;   // Keeps most neighbors inside the band.
+};
+
+struct WFCVolumeLayout {
+    static constexpr int DIRECTIONS = 6;
+    static constexpr int MIN_REGION_LAYERS = 4;
+};
+
+struct WFCGraphLayout {
+    static constexpr int DIRECTIONS = NUM_DIRECTIONS;
+    static constexpr int MIN_REGION_LAYERS = 16;
+};
+
+//------------------------------------------------------------------------------
+// WFCSolver: The collapse, propagation and backtracking core, instantiated for
+// one domain width and layout. Word is the domain word type and Words the
+// number of words per cell, or 0 for a count chosen at runtime (DOMAIN_WIDE).
+// With a single fixed word every domain operation is one register operation,
+// and the per-direction loops of the propagators are unrolled.
+template <typename Word, int Words, typename Layout>
+class WFCSolver final : public WFC {
+private:
+    using Domain = WFCDomain<Word, Words>;
+    static constexpr int DIRS = Layout::DIRECTIONS;
+    static constexpr bool GRAPH = is_same_v<Layout, WFCGraphLayout>;
+    static constexpr GridLayout LAYOUT = GRAPH ? LAYOUT_GRAPH : DIRS == 4 ? LAYOUT_PLANAR : LAYOUT_VOLUME;
+
+    // Graph layout: the topology's edge arrays.
+    const int* edgeStart = nullptr;
+    const int* edgeTarget = nullptr;
+    const uint8_t* edgeDirection = nullptr;
+
+    int wordsPerCell;                       // Domain words per cell.
+    vector<Word> domainWords;               // [cell][word] possible tile IDs.
+
+    // Adjacency rows in the domain's word type: the rule set's rows when
+    // they already are 64-bit words, otherwise a narrowed copy.
+    vector<Word> narrowRows;
+    const Word* rowData;
+    int rowStride;
+
+    // Initial propagator state, computed from the rules on the first use
+    // and kept across reset().
+    vector<uint16_t> initialSupportCounts;  // AC-4: [tile][direction] initial counters.
+    vector<Word> placeableWords;            // Bitset: [direction][word] tiles with a compatible neighbor.
+    uint8_t restrictedDirections = 0;       // Bitset: directions where some tile has none.
+
+    // Parallel propagation (setPropagationThreads()). A cascade that reaches
+    // PARALLEL_MIN_CASCADE cells, visited and pending, is split into bands of
+    // layers, one per worker thread. A worker narrows the cells of its own
+    // band directly, and sends the support mask for a cell of a neighboring
+    // band through the queue of that border, to be applied by the band's
+    // owner in the next round. A worker handles at most PARALLEL_ROUND_CELLS
+    // cells per round, so that a cascade running into a border reaches the
+    // next band after one round rather than after the whole band. Rounds end
+    // at a barrier; propagation is done after a round in which no mask was
+    // sent and every worklist is empty. The calling thread works on the first
+    // band and the threads of regionPool, kept across cascades, on the
+    // others. The cell heap and the counters are updated afterwards, on the
+    // calling thread.
+    struct Region {
+        int firstCell, endCell;             // Cells [firstCell, endCell) owned by the worker.
+        vector<int> worklist;               // Cells of the band to propagate.
+        vector<int> changed;                // Cells of the band that lost tiles.
+        vector<pair<int, int>> trail;       // (cell, tile) removals, appended to the trail afterwards.
+        vector<int> outCells[2][2];         // [round parity][ABOVE or BELOW border] target cells.
+        vector<Word> outMasks[2][2];        // [round parity][ABOVE or BELOW border] support masks.
+    };
+    static constexpr int ABOVE = 0, BELOW = 1;
+    static constexpr size_t PARALLEL_MIN_CASCADE = 4096;  // Cells that make a cascade go parallel.
+    static constexpr size_t PARALLEL_ROUND_CELLS = 256;   // Cells a worker handles per round.
+    vector<Region> regions;
+    int cellsPerRegion;
+    int regionThreads = 0;                  // propagationThreads the regions were made for.
+    unique_ptr<WFCThreadPool> regionPool;   // Workers of every region but the first.
+    vector<uint8_t> changedFlags;           // [cell] whether the cell is in its region's changed list.
+
+    Domain domain(int cell) {
+        return Domain(&domainWords[(size_t)cell * wordsPerCell], wordsPerCell);
+    }
+
+    const Word* row(Direction dir, int tileID) const {
+        return rowData + ((size_t)dir * tileDefinitions.size() + tileID) * rowStride;
+    }
+
+    // Whether a cell has a neighbor in direction d.
+    bool linked(int cell, int d) const {
+        if constexpr (DIRS == 4)
+            return hasNeighbor(cell, d);
+        else
+            return (neighborMasks[cell] >> d) & 1;
+    }
+
+    // Calls f(d, neighbor) for each direction d in which the cell has a
+    // neighbor. d is a compile-time constant, except on a graph, where the
+    // cell's edges are walked in order.
+    template <typename F>
+    void forEachNeighbor(int cell, F f) const {
+        if constexpr (GRAPH) {
+            for (int e = edgeStart[cell], end = edgeStart[cell + 1]; e < end; e++)
+                f(static_cast<Direction>(edgeDirection[e]), edgeTarget[e]);
+        } else if constexpr (DIRS == 4) {
+            forEachDirection([&](auto d) {
+                if (hasNeighbor(cell, d))
+                    f(d, cell + neighborOffset[d]);
+            });
+        } else {
+            unsigned links = neighborMasks[cell];
+            forEachDirection<DIRS>([&](auto d) {
+                if ((links >> d) & 1)
+                    f(d, volumeNeighbor(cell, d));
+            });
+        }
+    }
+
+    // Cells per layer and number of layers, for parallel propagation.
+    int layerCells() const {
+        if constexpr (GRAPH)
+            return topology->bandwidth;
+        return LAYOUT == LAYOUT_VOLUME ? bricksX * bricksY * 64 : width;
+    }
+    int numLayers() const {
+        if constexpr (GRAPH)
+            return (numCells + layerCells() - 1) / layerCells();
+        return LAYOUT == LAYOUT_VOLUME ? bricksZ : height;
+    }
+
+    // Computes into out the tiles that may sit in direction dir of at least
+    // one tile of the given domain: the OR of the domain's rows.
+    void supported(Direction dir, const Domain& from, Domain out) const {
+        out.assignUnionOfRows(row(dir, 0), from);
+    }
+
+    // Removes a tile from a cell. The caller reports the new domain size
+    // through domainShrunk() once it is done removing tiles from the cell.
+    void removeFromDomain(int cell, int tileID) {
+        domain(cell).reset(tileID);
+        tileRemoved(cell, tileID);
+        if (propagatorMode == PROPAGATE_AC4)
+            removals.emplace_back(cell, tileID);
+    }
+
+    // Chooses a random possibility of a cell, with a probability proportional
+    // to its weight.
+    int chooseTile(int cell) {
+        Domain possibilities = domain(cell);
+        if (rules->uniformWeights)
+            return possibilities.nth(rng.nextBelow(possibilities.count()));
+        double r = rng.nextDouble() * sumWeights[cell];
+        int chosen = -1, last = -1;
+        possibilities.forEach([&](int tileID) {
+            last = tileID;
+            if (chosen < 0) {
+                r -= weights[tileID];
+                if (r < 0)
+                    chosen = tileID;
+            }
+        });
+        // Rounding in the cached sum can leave r slightly positive.
+        return chosen >= 0 ? chosen : last;
+    }
+
+    // AC-4: removes a tile from a cell and queues the removal so that
+    // propagate() updates the support counters around it.
+    void removeTile(int cell, int tileID) {
+        removeFromDomain(cell, tileID);
+        domainShrunk(cell, domain(cell).count());
+    }
+
+    // Undoes one trail entry: puts the tile back into the cell, restores the
+    // cached sums and, for AC-4, the support counters its removal decremented.
+    void restoreTile(int cell, int tileID) {
+        Domain possibilities = domain(cell);
+        possibilities.set(tileID);
+        sumWeights[cell] += weights[tileID];
+        sumWeightLogWeights[cell] += weightLogWeights[tileID];
+        if (propagatorMode == PROPAGATE_AC4) {
+            int numTiles = tileDefinitions.size();
+            forEachNeighbor(cell, [&](auto d, int neighbor) {
+                const int back = opposite(d);
+                uint16_t* counts = &supportCounts[(size_t)neighbor * numTiles * DIRS];
+                adjacency.forEachAllowed(d, tileID, [&](int neighborTile) {
+                    counts[neighborTile * DIRS + back]++;
+                });
+            });
+        }
+        if (collapsedFlags[cell] && possibilities.count() > 1) {
+            collapsedFlags[cell] = 0;
+            finalTiles.set(cell, -1);
+            uncollapsedCells++;
+        }
+        if (!collapsedFlags[cell])
+            cellHeap.insertOrUpdate(cell, entropy(cell));
+    }
+
+    // Backtracks from a contradiction: undoes the most recent decision and
+    // bans the tile it chose, repeating with older decisions while that still
+    // leads to a contradiction. Returns false when no decision is left or the
+    // backtrack limit has been reached.
+    bool backtrack() {
+        while (contradiction) {
+            if (decisions.empty() || backtracks >= backtrackLimit)
+                return false;
+            Decision decision = decisions.back();
+            decisions.pop_back();
+            backtracks++;
+            while (trail.size() > decision.trailSize) {
+                auto [cell, tileID] = trail.back();
+                trail.pop_back();
+                restoreTile(cell, tileID);
+            }
+            contradiction = false;
+            // The ban is recorded on the trail of the parent decision.
+            removeFromDomain(decision.cell, decision.tileID);
+            domainShrunk(decision.cell, domain(decision.cell).count());
+            if (propagatorMode == PROPAGATE_BITSET)
+                enqueue(decision.cell);
+            propagate();
+        }
+        return true;
+    }
+
+    // Called after a cell lost possibilities: collapses it once a single
+    // tile is left and keeps its entry in the cell heap up to date.
+    void domainShrunk(int cell, int remaining) {
+        if (remaining == 1 && !collapsedFlags[cell])
+            setCollapsed(cell, domain(cell).nth(0));
+        else if (remaining == 0)
+            contradiction = true;
+        if (remaining <= 1)
+            cellHeap.remove(cell);
+        else
+            cellHeap.update(cell, entropy(cell));
+    }
+
+    // Sets up the propagator state and removes the tiles that have no
+    // compatible neighbor in a direction where the cell has a neighbor.
+    void initPropagator() {
+        int numTiles = tileDefinitions.size();
+        if (propagatorMode == PROPAGATE_AC4) {
+            if (numTiles > numeric_limits<uint16_t>::max()) {
+                cerr << "Too many tiles for the ac4 propagator, using bitset." << endl;
+                propagatorMode = PROPAGATE_BITSET;
+            } else if (GRAPH && !topology->uniqueDirections) {
+                cerr << "Topology has cells with two edges in one direction, using bitset." << endl;
+                propagatorMode = PROPAGATE_BITSET;
+            }
+        }
+        if (propagatorMode == PROPAGATE_AC4) {
+            // Every neighbor starts with a full domain, so the initial count is
+            // the number of tiles allowed next to the tile in that direction.
+            vector<uint16_t>& initial = initialSupportCounts;
+            if (initial.empty()) {
+                initial.resize(numTiles * DIRS);
+                for (int t = 0; t < numTiles; t++)
+                    for (int d = 0; d < DIRS; d++)
+                        initial[t * DIRS + d] = adjacency.countAllowed(static_cast<Direction>(d), t);
+            }
+            supportCounts.resize((size_t)numCells * numTiles * DIRS);
+            for (size_t cell = 0; cell < (size_t)numCells; cell++)
+                copy(initial.begin(), initial.end(), supportCounts.begin() + cell * numTiles * DIRS);
+
+            for (int cell = 0; cell < numCells; cell++)
+                for (int d = 0; d < DIRS; d++) {
+                    if (!linked(cell, d))
+                        continue;
+                    for (int t = 0; t < numTiles; t++)
+                        if (initial[t * DIRS + d] == 0 && domain(cell).test(t))
+                            removeTile(cell, t);
+                }
+        } else {
+            if (placeableWords.empty()) {
+                // Tiles with at least one compatible neighbor in each direction.
+                placeableWords.resize(DIRS * wordsPerCell);
+                for (int d = 0; d < DIRS; d++) {
+                    Domain placeable(&placeableWords[d * wordsPerCell], wordsPerCell);
+                    placeable.fill(numTiles);
+                    for (int t = 0; t < numTiles; t++) {
+                        if (adjacency.countAllowed(static_cast<Direction>(d), t) == 0) {
+                            placeable.reset(t);
+                            restrictedDirections |= 1 << d;
+                        }
+                    }
+                }
+            }
+            for (int d = 0; d < DIRS; d++) {
+                if (!(restrictedDirections & (1 << d)))
+                    continue;
+                Domain placeable(&placeableWords[d * wordsPerCell], wordsPerCell);
+                for (int cell = 0; cell < numCells; cell++) {
+                    if (!linked(cell, d))
+                        continue;
+                    Domain possibilities = domain(cell);
+                    bool removed = false;
+                    possibilities.intersect(placeable, [&](int tileID) {
+                        tileRemoved(cell, tileID);
+                        removed = true;
+                    });
+                    if (removed) {
+                        int after = possibilities.count();
+                        domainShrunk(cell, after);
+                        if (after > 0)
+                            enqueue(cell);
+                    }
+                }
+            }
+        }
+        propagate();
+    }
+
+    // Fills every domain and applies the initial constraints.
+    void resetDomains() {
+        domainWords.resize((size_t)numCells * wordsPerCell);
+        for (int cell = 0; cell < numCells; cell++)
+            domain(cell).fill(tileDefinitions.size());
+        initPropagator();
+    }
+
+    // AC-4 after a contradiction: applies the counter decrements of the
+    // removals still queued, without removing more tiles, so that every
+    // removal on the trail has been fully counted and can be undone exactly.
+    void drainRemovals() {
+        int numTiles = tileDefinitions.size();
+        for (auto [cell, tileID] : removals) {
+            forEachNeighbor(cell, [&](auto d, int neighbor) {
+                const int back = opposite(d);
+                uint16_t* counts = &supportCounts[(size_t)neighbor * numTiles * DIRS];
+                adjacency.forEachAllowed(d, tileID, [&](int neighborTile) {
+                    counts[neighborTile * DIRS + back]--;
+                });
+            });
+        }
+    }
+
+    // Propagates constraints outward from the cells in the worklist. Only the
+    // neighbors of a cell whose domain actually shrank are revisited, so the
+    // cost is proportional to the region affected by the last collapse. A
+    // cascade that reaches PARALLEL_MIN_CASCADE cells, counting those already
+    // visited and those still queued, is handed over to propagateParallel()
+    // when propagation threads are enabled.
+    void propagateWorklist() {
+        vector<Word> supportedWords(wordsPerCell);
+        Domain supportedTiles(supportedWords.data(), wordsPerCell);
+        bool parallel = propagationThreads > 1 && numLayers() >= 2 * Layout::MIN_REGION_LAYERS;
+        size_t visited = 0;
+        while (!worklist.empty() && !contradiction) {
+            if (parallel && visited + worklist.size() >= PARALLEL_MIN_CASCADE) {
+                propagateParallel();
+                break;
+            }
+            visited++;
+            int cell = worklist.back();
+            worklist.pop_back();
+            queued[cell] = false;
+            forEachNeighbor(cell, [&](auto d, int neighbor) {
+                // Keep only the neighbor's candidates that some tile still
+                // possible in this cell accepts in direction d. Collapsed
+                // neighbors are checked too: losing their tile is a
+                // contradiction.
+                supported(d, domain(cell), supportedTiles);
+                Domain possibilities = domain(neighbor);
+                bool removed = false;
+                possibilities.intersect(supportedTiles, [&](int tileID) {
+                    tileRemoved(neighbor, tileID);
+                    removed = true;
+                });
+                if (removed) {
+                    int after = possibilities.count();
+                    domainShrunk(neighbor, after);
+                    if (after > 0)
+                        enqueue(neighbor);
+                }
+            });
+        }
+    }
+
+    // Parallel propagation: intersects a cell of the region with a support
+    // mask, and queues the cell in the region if it shrank.
+    void narrowInRegion(Region& region, int cell, const Domain& mask, atomic<bool>& stop) {
+        Domain possibilities = domain(cell);
+        bool removed = false;
+        possibilities.intersect(mask, [&](int tileID) {
+            subtractWeight(cell, tileID);
+            if (!decisions.empty())
+                region.trail.emplace_back(cell, tileID);
+            removed = true;
+        });
+        if (!removed)
+            return;
+        if (!changedFlags[cell]) {
+            changedFlags[cell] = 1;
+            region.changed.push_back(cell);
+        }
+        if (possibilities.empty()) {
+            stop = true;
+        } else if (!queued[cell]) {
+            queued[cell] = 1;
+            region.worklist.push_back(cell);
+        }
+    }
+
+    // Propagates the worklist with one worker thread per band of layers until
+    // no cell changes or a cell runs out of possibilities, then reports the
+    // changed cells through domainShrunk().
+    void propagateParallel() {
+        if (regions.empty() || regionThreads != propagationThreads) {
+            int layers = numLayers();
+            int layersPerRegion = max(Layout::MIN_REGION_LAYERS, (layers + propagationThreads - 1) / propagationThreads);
+            cellsPerRegion = layersPerRegion * layerCells();
+            regions.resize((layers + layersPerRegion - 1) / layersPerRegion);
+            for (size_t r = 0; r < regions.size(); r++) {
+                regions[r].firstCell = r * cellsPerRegion;
+                regions[r].endCell = min(numCells, (int)(r + 1) * cellsPerRegion);
+            }
+            changedFlags.assign(numCells, 0);
+            regionThreads = propagationThreads;
+            if (!regionPool || regionPool->numThreads() != (int)regions.size() - 1)
+                regionPool = make_unique<WFCThreadPool>(regions.size() - 1);
+        }
+        int numRegions = regions.size();
+        for (int cell : worklist)
+            regions[cell / cellsPerRegion].worklist.push_back(cell);
+        worklist.clear();
+
+        atomic<bool> stop(false);       // Set when a cell has no possibility left.
+        atomic<size_t> sent(0);         // Masks sent across borders in this round.
+        atomic<int> busy(0);            // Regions with cells left in their worklist.
+        bool done = false;
+        barrier roundEnd(numRegions, [&]() noexcept {
+            done = (sent.load() == 0 && busy.load() == 0) || stop.load();
+            sent = 0;
+            busy = 0;
+        });
+        auto work = [&](int r) {
+            Region& region = regions[r];
+            vector<Word> maskWords(wordsPerCell);
+            Domain mask(maskWords.data(), wordsPerCell);
+            for (int round = 0; !done; round++) {
+                int parity = round & 1;
+                // Apply the masks the neighboring bands sent in the previous
+                // round: the band above through its BELOW border, the band
+                // below through its ABOVE border.
+                for (int from : { r - 1, r + 1 }) {
+                    if (from < 0 || from >= numRegions)
+                        continue;
+                    int border = from < r ? BELOW : ABOVE;
+                    vector<int>& cells = regions[from].outCells[parity ^ 1][border];
+                    vector<Word>& masks = regions[from].outMasks[parity ^ 1][border];
+                    for (size_t i = 0; i < cells.size() && !stop.load(memory_order_relaxed); i++)
+                        narrowInRegion(region, cells[i], Domain(&masks[i * wordsPerCell], wordsPerCell), stop);
+                    cells.clear();
+                    masks.clear();
+                }
+                size_t count = 0;
+                for (size_t budget = PARALLEL_ROUND_CELLS;
+                     budget > 0 && !region.worklist.empty() && !stop.load(memory_order_relaxed); budget--) {
+                    int cell = region.worklist.back();
+                    region.worklist.pop_back();
+                    queued[cell] = 0;
+                    forEachNeighbor(cell, [&](auto d, int neighbor) {
+                        supported(d, domain(cell), mask);
+                        if (neighbor >= region.firstCell && neighbor < region.endCell) {
+                            narrowInRegion(region, neighbor, mask, stop);
+                        } else {
+                            int border = neighbor < region.firstCell ? ABOVE : BELOW;
+                            region.outCells[parity][border].push_back(neighbor);
+                            region.outMasks[parity][border].insert(region.outMasks[parity][border].end(),
+                                                                   mask.data(), mask.data() + wordsPerCell);
+                            count++;
+                        }
+                    });
+                }
+                sent += count;
+                if (!region.worklist.empty())
+                    busy++;
+                roundEnd.arrive_and_wait();
+            }
+        };
+        for (int r = 1; r < numRegions; r++)
+            regionPool->submit([&work, r]() { work(r); });
+        work(0);
+        regionPool->wait();
+
+        // Drop what a contradiction left pending, then do the bookkeeping.
+        for (Region& region : regions) {
+            for (int cell : region.worklist)
+                queued[cell] = 0;
+            region.worklist.clear();
+            for (auto& borders : region.outCells)
+                for (auto& cells : borders)
+                    cells.clear();
+            for (auto& borders : region.outMasks)
+                for (auto& masks : borders)
+                    masks.clear();
+            trail.insert(trail.end(), region.trail.begin(), region.trail.end());
+            region.trail.clear();
+        }
+        for (Region& region : regions) {
+            for (int cell : region.changed) {
+                changedFlags[cell] = 0;
+                domainShrunk(cell, domain(cell).count());
+            }
+            region.changed.clear();
+        }
+    }
+
+    // AC-4: for each pending removal of tile t from a cell, decrements the
+    // counters of the neighbor tiles that t supported. A neighbor tile whose
+    // counter reaches zero has lost its last support and is removed in turn.
+    void propagateSupportCounts() {
+        int numTiles = tileDefinitions.size();
+        while (!removals.empty() && !contradiction) {
+            auto [cell, tileID] = removals.back();
+            removals.pop_back();
+            forEachNeighbor(cell, [&](auto d, int neighbor) {
+                const int back = opposite(d);
+                uint16_t* counts = &supportCounts[(size_t)neighbor * numTiles * DIRS];
+                Domain possibilities = domain(neighbor);
+                adjacency.forEachAllowed(d, tileID, [&](int neighborTile) {
+                    if (--counts[neighborTile * DIRS + back] == 0 && possibilities.test(neighborTile))
+                        removeTile(neighbor, neighborTile);
+                });
+            });
+        }
+    }
+
+public:
+    WFCSolver(int w, int h, int d, shared_ptr<const WFCTopology> graph, int tSize, shared_ptr<const WFCRules> ruleSet,
+              PropagatorMode mode, uint64_t solverSeed)
+        : WFC(w, h, d, LAYOUT, move(graph), tSize, move(ruleSet), mode, solverSeed)
+    {
+        if constexpr (GRAPH) {
+            edgeStart = topology->edgeStart.data();
+            edgeTarget = topology->edgeTarget.data();
+            edgeDirection = topology->edgeDirection.data();
+        }
+        int numTileTypes = tileDefinitions.size();
+        wordsPerCell = Words ? Words : (numTileTypes + Domain::BITS - 1) / Domain::BITS;
+        if constexpr (is_same_v<Word, uint64_t>) {
+            rowData = adjacency.row(NORTH, 0);
+            rowStride = adjacency.numWords();
+        } else {
+            narrowRows.resize(DIRS * numTileTypes);
+            for (int dir = 0; dir < DIRS; dir++)
+                for (int t = 0; t < numTileTypes; t++)
+                    narrowRows[dir * numTileTypes + t] = static_cast<Word>(adjacency.row(static_cast<Direction>(dir), t)[0]);
+            rowData = narrowRows.data();
+            rowStride = 1;
+        }
+        resetDomains();
+    }
+
+    void reset(int w, int h, int d, uint64_t solverSeed) override {
+        if constexpr (GRAPH) {
+            w = width;
+            h = height;
+            d = depth;
+        } else if (DIRS == 4 && d != 1) {
+            cerr << "A planar solver cannot hold a volume; use createVolume()." << endl;
+            d = 1;
+        }
+        if (w != width || h != height || d != depth)
+            regions.clear();
+        resetGrid(w, h, d, solverSeed);
+        resetDomains();
+    }
+
+    bool run() override {
+        while (uncollapsedCells > 0 || contradiction) {
+            if (cancelFlag && cancelFlag->load(memory_order_relaxed))
+                return false;
+            if (!step())
+                return false;
+        }
+        return true;
+    }
+
+    bool step() override {
+        if (uncollapsedCells == 0 && !contradiction)
+            return false;
+        // The heap only holds uncollapsed cells that still have a
+        // possibility; if it is empty, the remaining cells have none.
+        if (contradiction || cellHeap.empty())
+            return backtrackLimit > 0 && backtrack();
+        collapseCell(cellHeap.top());
+        propagate();
+        return true;
+    }
+
+    void collapseCell(int cell) override {
+        int tileID = chooseTile(cell);
+        if (backtrackLimit > 0)
+            decisions.push_back(Decision{ trail.size(), cell, tileID });
+        domain(cell).forEach([&](int removed) {
+            if (removed != tileID)
+                removeFromDomain(cell, removed);
+        });
+        domainShrunk(cell, 1);
+        if (propagatorMode == PROPAGATE_BITSET)
+            enqueue(cell);
+    }
+
+    void propagate() override {
+        if (propagatorMode == PROPAGATE_AC4)
+            propagateSupportCounts();
+        else
+            propagateWorklist();
+        if (contradiction) {
+            for (int cell : worklist)
+                queued[cell] = false;
+            worklist.clear();
+            if (!decisions.empty())
+                drainRemovals();
+            removals.clear();
+        }
+    }
+
+    void constrainCell(int x, int y, int z, const uint64_t* allowed) override {
+        int cell = cellIndex(x, y, z);
+        bool removed = false;
+        domain(cell).forEach([&](int tileID) {
+            if (!((allowed[tileID >> 6] >> (tileID & 63)) & 1)) {
+                removeFromDomain(cell, tileID);
+                removed = true;
+            }
+        });
+        if (!removed)
+            return;
+        int after = domain(cell).count();
+        domainShrunk(cell, after);
+        if (after > 0 && propagatorMode == PROPAGATE_BITSET)
+            enqueue(cell);
+    }
+
+    double stateBytesPerCell() const override {
+        size_t bytes = domainWords.size() * sizeof(Word)
+                     + collapsedFlags.size() * sizeof(uint8_t)
+                     + finalTiles.sizeInBytes()
+                     + (sumWeights.size() + sumWeightLogWeights.size()) * sizeof(double)
+                     + supportCounts.size() * sizeof(uint16_t)
+                     + neighborMasks.size() * sizeof(uint8_t);
+        return (double)bytes / ((double)width * height * depth);
+    }
+
+    DomainWidth getDomainWidth() const override {
+        return Words == 0 ? DOMAIN_WIDE : static_cast<DomainWidth>(Domain::BITS);
+    }
+};
+
+// Runtime dispatch from the domain width to the WFCSolver instantiation.
+template <typename Layout>
+static unique_ptr<WFC> createSolver(int w, int h, int d, shared_ptr<const WFCTopology> graph, int tSize,
+                                    shared_ptr<const WFCRules> ruleSet, PropagatorMode mode, uint64_t solverSeed,
+                                    DomainWidth domainWidth) {
+    DomainWidth narrowest = narrowestDomainWidth(ruleSet->tileDefinitions.size());
+    if (domainWidth == DOMAIN_AUTO || (narrowest == DOMAIN_WIDE && domainWidth != DOMAIN_WIDE)
+        || (domainWidth != DOMAIN_WIDE && domainWidth < narrowest))
+        domainWidth = narrowest;
+    switch (domainWidth) {
+    case DOMAIN_8:  return make_unique<WFCSolver<uint8_t, 1, Layout>>(w, h, d, move(graph), tSize, move(ruleSet), mode, solverSeed);
+    case DOMAIN_16: return make_unique<WFCSolver<uint16_t, 1, Layout>>(w, h, d, move(graph), tSize, move(ruleSet), mode, solverSeed);
+    case DOMAIN_32: return make_unique<WFCSolver<uint32_t, 1, Layout>>(w, h, d, move(graph), tSize, move(ruleSet), mode, solverSeed);
+    case DOMAIN_64: return make_unique<WFCSolver<uint64_t, 1, Layout>>(w, h, d, move(graph), tSize, move(ruleSet), mode, solverSeed);
+    default:        return make_unique<WFCSolver<uint64_t, 0, Layout>>(w, h, d, move(graph), tSize, move(ruleSet), mode, solverSeed);
+    }
+}
+
+unique_ptr<WFC> WFC::create(int w, int h, int tSize, shared_ptr<const WFCRules> ruleSet,
+                            PropagatorMode mode, uint64_t solverSeed, DomainWidth domainWidth) {
+    return createSolver<WFCPlanarLayout>(w, h, 1, nullptr, tSize, move(ruleSet), mode, solverSeed, domainWidth);
+}
+
+unique_ptr<WFC> WFC::createVolume(int w, int h, int d, int tSize, shared_ptr<const WFCRules> ruleSet,
+                                  PropagatorMode mode, uint64_t solverSeed, DomainWidth domainWidth) {
+    return createSolver<WFCVolumeLayout>(w, h, d, nullptr, tSize, move(ruleSet), mode, solverSeed, domainWidth);
+}
+
+unique_ptr<WFC> WFC::createGraph(shared_ptr<const WFCTopology> graph, int tSize, shared_ptr<const WFCRules> ruleSet,
+                                 PropagatorMode mode, uint64_t solverSeed, DomainWidth domainWidth) {
+    int cells = graph->numCells();
+    return createSolver<WFCGraphLayout>(cells, 1, 1, move(graph), tSize, move(ruleSet), mode, solverSeed, domainWidth);
+}
+
+//------------------------------------------------------------------------------
+// Portfolio solving.
+unique_ptr<WFC> solvePortfolio(shared_ptr<const WFCRules> rules, int w, int h, int tileSize,
+                               int numThreads, uint64_t seed, PropagatorMode mode,
+                               int backtrackLimit, int maxAttempts, DomainWidth domainWidth) {
+    atomic<bool> done(false);
+    mutex winnerMutex;
+    unique_ptr<WFC> winner;
+    vector<thread> threads;
+    WFCRandom streams(seed);
+    for (int i = 0; i < numThreads; i++) {
+        threads.emplace_back([&, stream = streams.split()]() mutable {
+            for (int attempt = 0; attempt < maxAttempts && !done.load(); attempt++) {
+                uint64_t solverSeed = stream.next();
+                auto solver = WFC::create(w, h, tileSize, rules, mode, solverSeed, domainWidth);
+                solver->setBacktrackLimit(backtrackLimit);
+                solver->setCancelFlag(&done);
+                if (solver->run()) {
+                    lock_guard<mutex> lock(winnerMutex);
+                    if (!winner) {
+                        winner = move(solver);
+                        done = true;
+                    }
+                    return;
+                }
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    // done lives on this stack frame, so the winner must not keep pointing to it.
+    if (winner)
+        winner->setCancelFlag(nullptr);
+    return winner;
+}
+
+//------------------------------------------------------------------------------
+// WFCThreadPool.
+bool WFCThreadPool::take(int self, function<void()>& task) {
+    int n = workers.size();
+    for (int i = 0; i < n; i++) {
+        Worker& victim = *workers[(self + i) % n];
+        lock_guard<mutex> lock(victim.lock);
+        if (victim.tasks.empty())
+            continue;
+        if (i == 0) {
+            task = move(victim.tasks.back());
+            victim.tasks.pop_back();
+        } else {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void WFCThreadPool::workerLoop(int self) {
+    currentPool = this;
+    currentWorker = self;
+    function<void()> task;
+    while (true) {
+        {
+            unique_lock<mutex> lock(stateLock);
+            wakeUp.wait(lock, [&] { return stopping || queuedTasks > 0; });
+            if (queuedTasks == 0)
+                return;
+            queuedTasks--;
+        }
+        // A queued task is reserved for this worker, so one is found.
+        while (!take(self, task)) {}
+        task();
+        task = nullptr;
+        lock_guard<mutex> lock(stateLock);
+        if (--unfinishedTasks == 0)
+            allDone.notify_all();
+    }
+}
+
+WFCThreadPool::WFCThreadPool(int numThreads) {
+    numThreads = max(1, numThreads);
+    for (int i = 0; i < numThreads; i++)
+        workers.push_back(make_unique<Worker>());
+    for (int i = 0; i < numThreads; i++)
+        threads.emplace_back(&WFCThreadPool::workerLoop, this, i);
+}
+
+WFCThreadPool::~WFCThreadPool() {
+    {
+        lock_guard<mutex> lock(stateLock);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto &t : threads)
+        t.join();
+}
+
+void WFCThreadPool::submit(function<void()> task) {
+    int target = currentPool == this ? currentWorker : (int)(nextWorker++ % workers.size());
+    {
+        lock_guard<mutex> lock(workers[target]->lock);
+        workers[target]->tasks.push_back(move(task));
+    }
     {
+        lock_guard<mutex> lock(stateLock);
+        queuedTasks++;
+        unfinishedTasks++;
+    }
+    wakeUp.notify_one();
+}
+
+void WFCThreadPool::wait() {
+    unique_lock<mutex> lock(stateLock);
+    allDone.wait(lock, [&] { return unfinishedTasks == 0; });
+}
+
+//------------------------------------------------------------------------------
+// Job scheduling.
+vector<WFCJobReport> runJobs(shared_ptr<const WFCRules> rules, const vector<WFCJob>& jobs, int numThreads,
+                             int tileSize, PropagatorMode mode, int backtrackLimit) {
+    using Clock = chrono::steady_clock;
+    auto msSince = [](Clock::time_point start) {
+        return chrono::duration<double, milli>(Clock::now() - start).count();
+    };
+    vector<WFCJobReport> reports(jobs.size());
+    vector<size_t> order(jobs.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return (long long)jobs[a].width * jobs[a].height > (long long)jobs[b].width * jobs[b].height;
+    });
+
+    WFCThreadPool pool(numThreads);
+    Clock::time_point submitted = Clock::now();
+    for (size_t i : order) {
+        pool.submit([&, i] {
+            const WFCJob& job = jobs[i];
+            WFCJobReport& report = reports[i];
+            Clock::time_point solveStart = Clock::now();
+            shared_ptr<WFC> wfc = WFC::create(job.width, job.height, tileSize, rules, mode, job.seed);
+            wfc->setBacktrackLimit(backtrackLimit);
+            bool solved = wfc->run();
+            report.solveMs = msSince(solveStart);
+            if (!solved) {
+                report.latencyMs = msSince(submitted);
+                return;
+            }
+            pool.submit([&, i, wfc] {
+                Clock::time_point renderStart = Clock::now();
+                auto pixels = make_shared<vector<unsigned char>>();
+                wfc->renderImage(*pixels);
+                int imageWidth = wfc->getWidth() * tileSize, imageHeight = wfc->getHeight() * tileSize;
+                reports[i].renderMs = msSince(renderStart);
+                pool.submit([&, i, pixels, imageWidth, imageHeight] {
+                    Clock::time_point encodeStart = Clock::now();
+                    int length = 0;
+                    unsigned char* png = stbi_write_png_to_mem(pixels->data(), imageWidth * 3,
+                                                               imageWidth, imageHeight, 3, &length);
+                    bool written = false;
+                    if (png) {
+                        ofstream out(jobs[i].outputFile, ios::binary);
+                        written = (bool)out.write(reinterpret_cast<const char*>(png), length);
+                        STBIW_FREE(png);
+                    }
+                    reports[i].encodeMs = msSince(encodeStart);
+                    reports[i].complete = written;
+                    reports[i].latencyMs = msSince(submitted);
+                });
+            });
+        });
+    }
+    pool.wait();
+    return reports;
+}
+
+bool loadJobs(const string& filename, vector<WFCJob>& jobs) {
+    ifstream infile(filename);
+    if (!infile.is_open()) {
+        cerr << "Failed to open file: " << filename << endl;
+        return false;
+    }
+    string line;
+    while (getline(infile, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        istringstream iss(line);
+        WFCJob job;
+        if (!(iss >> job.width >> job.height >> job.seed >> job.outputFile) || job.width <= 0 || job.height <= 0) {
+            cerr << "Invalid job line: " << line << endl;
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// WFCWorld.
+bool WFCWorld::solve(int cx, int cy, ChunkRecord& record, int attempts) {
+    // A side with no neighbor yet is solved with a margin of extra cells
+    // that are then dropped. Cells on the chunk's edge would otherwise only
+    // have to fit their neighbors inside the chunk, and many such edges
+    // cannot be continued by the chunk generated next to them later; the
+    // margin proves that the edge can.
+    int margin[4];
+    for (int d = 0; d < 4; d++)
+        margin[d] = (record.constrainedBy | record.pinned) & (1 << d) ? 0 : max(1, chunkSize / 4);
+    int left = margin[WEST], top = margin[NORTH];
+    int gridWidth = left + chunkSize + margin[EAST], gridHeight = top + chunkSize + margin[SOUTH];
+    vector<uint64_t> only(rules->adjacency.numWords(), 0);
+    for (int attempt = record.attempt; attempt < record.attempt + attempts; attempt++) {
+        auto wfc = WFC::create(gridWidth, gridHeight, 1, rules, propagatorMode, chunkSeed(cx, cy, attempt));
+        wfc->setBacktrackLimit(backtrackLimit);
+        for (int d = 0; d < 4; d++) {
+            if (record.pinned & (1 << d)) {
+                for (int i = 0; i < chunkSize; i++) {
+                    int x, y, tileID = record.edges[d][i];
+                    edgeCell(d, i, x, y);
+                    only[tileID >> 6] |= 1ull << (tileID & 63);
+                    wfc->constrainCell(left + x, top + y, only.data());
+                    only[tileID >> 6] = 0;
+                }
+            }
+            if (!(record.constrainedBy & (1 << d)))
+                continue;
+            // The neighbor's edge facing this chunk; each of our edge cells
+            // must be allowed next to the neighbor tile it touches.
+            Direction back = opposite(static_cast<Direction>(d));
+            const vector<int>& border = chunks.at({ cx + dx[d], cy + dy[d] }).edges[back];
+            for (int i = 0; i < chunkSize; i++) {
+                int x, y;
+                edgeCell(d, i, x, y);
+                wfc->constrainCell(left + x, top + y, rules->adjacency.row(back, border[i]));
+            }
+        }
+        wfc->propagate();
+        if (!wfc->run())
+            continue;
+        record.attempt = attempt;
+        record.tiles.reset(chunkSize * chunkSize, rules->tileDefinitions.size());
+        for (int y = 0; y < chunkSize; y++)
+            for (int x = 0; x < chunkSize; x++)
+                record.tiles.set(y * chunkSize + x, wfc->tileAt(left + x, top + y));
+        for (int d = 0; d < 4; d++) {
+            record.edges[d].resize(chunkSize);
+            for (int i = 0; i < chunkSize; i++) {
+                int x, y;
+                edgeCell(d, i, x, y);
+                record.edges[d][i] = wfc->tileAt(left + x, top + y);
+            }
+        }
+        record.resident = true;
+        return true;
+    }
+    return false;
+}
+
+bool WFCWorld::generate(int cx, int cy) {
+    auto found = chunks.find({ cx, cy });
+    if (found != chunks.end()) {
+        if (found->second.resident || found->second.failed)
+            return !found->second.failed;
+        ChunkRecord& record = found->second;
+        if (!solve(cx, cy, record, 1)) {
+            cerr << "Failed to regenerate chunk " << cx << "," << cy << endl;
+            return false;
+        }
+        return true;
+    }
+    ChunkRecord record;
+    record.constrainedBy = 0;
+    record.pinned = 0;
+    record.attempt = 0;
+    record.resident = false;
+    record.failed = false;
+    for (int d = 0; d < 4; d++) {
+        auto neighbor = chunks.find({ cx + dx[d], cy + dy[d] });
+        if (neighbor != chunks.end() && !neighbor->second.failed)
+            record.constrainedBy |= 1 << d;
+    }
+    if (!solve(cx, cy, record, maxAttempts) && !repair(cx, cy, record)) {
+        cerr << "Failed to generate chunk " << cx << "," << cy << endl;
+        record.failed = true;
+    }
+    bool solved = !record.failed;
+    chunks.emplace(make_pair(cx, cy), move(record));
+    return solved;
+}
+
+bool WFCWorld::repair(int cx, int cy, ChunkRecord& record) {
+    for (int d = 0; d < 4; d++) {
+        if (!(record.constrainedBy & (1 << d)))
+            continue;
+        int nx = cx + dx[d], ny = cy + dy[d];
+        ChunkRecord& neighbor = chunks.at({ nx, ny });
+        if (!generate(nx, ny))
+            continue;
+        ChunkRecord saved = neighbor;
+        // The chunks generated after the neighbor were solved against its
+        // edges as they are; the ones before it still constrain it.
+        for (int e = 0; e < 4; e++) {
+            auto other = chunks.find({ nx + dx[e], ny + dy[e] });
+            if (other != chunks.end() && !other->second.failed && !(neighbor.constrainedBy & (1 << e)))
+                neighbor.pinned |= 1 << e;
+        }
+        int nextAttempt = saved.attempt + 1;
+        for (int round = 0; round < maxAttempts; round++) {
+            neighbor.attempt = nextAttempt;
+            if (!solve(nx, ny, neighbor, maxAttempts))
+                break;
+            nextAttempt = neighbor.attempt + 1;
+            record.attempt = 0;
+            if (solve(cx, cy, record, maxAttempts))
+                return true;
+        }
+        neighbor = move(saved);
+    }
+    return false;
+}
+
+void WFCWorld::evict(int cx, int cy) {
+    auto found = chunks.find({ cx, cy });
+    if (found != chunks.end() && found->second.resident) {
+        found->second.tiles = WFCTileIndexBuffer();
+        found->second.resident = false;
+    }
+}
+
+int WFCWorld::tileAt(long long x, long long y) {
+    long long cx = x >= 0 ? x / chunkSize : (x + 1) / chunkSize - 1;
+    long long cy = y >= 0 ? y / chunkSize : (y + 1) / chunkSize - 1;
+    if (!generate((int)cx, (int)cy))
+        return -1;
+    const ChunkRecord& record = chunks.at({ (int)cx, (int)cy });
+    return record.tiles.get((int)(y - cy * chunkSize) * chunkSize + (int)(x - cx * chunkSize));
+}
+
+bool WFCWorld::generateImage(const string& filename, int cx0, int cy0, int cx1, int cy1, int tileSize) {
+    int imageWidth = (cx1 - cx0 + 1) * chunkSize * tileSize;
+    int imageHeight = (cy1 - cy0 + 1) * chunkSize * tileSize;
+    int channels = 3; // RGB
+    vector<unsigned char> image((size_t)imageWidth * imageHeight * channels, 200);
+    int failedChunks = 0;
+    for (int cy = cy0; cy <= cy1; cy++)
+        for (int cx = cx0; cx <= cx1; cx++)
+            failedChunks += !generate(cx, cy);
+    for (int y = 0; y < imageHeight / tileSize; y++) {
+        for (int x = 0; x < imageWidth / tileSize; x++) {
+            int tileID = tileAt((long long)cx0 * chunkSize + x, (long long)cy0 * chunkSize + y);
+            if (tileID < 0)
+                continue;
+            const WFCTileDefinition& def = rules->tileDefinitions[tileID];
+            for (int ty = 0; ty < tileSize; ty++) {
+                unsigned char* pixel = &image[(((size_t)y * tileSize + ty) * imageWidth + (size_t)x * tileSize) * channels];
+                for (int tx = 0; tx < tileSize; tx++, pixel += channels) {
+                    pixel[0] = def.r;
+                    pixel[1] = def.g;
+                    pixel[2] = def.b;
+                }
+            }
+        }
+    }
+    if (!stbi_write_png(filename.c_str(), imageWidth, imageHeight, channels, image.data(), imageWidth * channels)) {
+        cerr << "Error writing image file." << endl;
+        return false;
+    }
+    cout << "Image generated: " << filename << endl;
+    if (failedChunks > 0) {
+        cerr << failedChunks << " chunks could not be generated and are left grey." << endl;
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// WFCMappedFile: Read-write memory mapping of a file created with a given
+// size. Pages are loaded and written back by the OS on demand, so the mapping
+// can be far larger than the available memory. A new file reads as zeros.
+class WFCMappedFile {
+private:
+    uint8_t* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mappingHandle = NULL;
+#else
+    int fd = -1;
+#endif
+
+public:
+    WFCMappedFile() = default;
+    WFCMappedFile(const WFCMappedFile&) = delete;
+    WFCMappedFile& operator=(const WFCMappedFile&) = delete;
+    ~WFCMappedFile() { close(); }
+
+    // Creates (or truncates) a file of numBytes bytes and maps it.
+    bool create(const string& path, size_t numBytes) {
+        close();
+#ifdef _WIN32
+        fileHandle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                 CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+            return false;
+        mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READWRITE,
+                                           (DWORD)((uint64_t)numBytes >> 32), (DWORD)numBytes, NULL);
+        if (!mappingHandle) {
+            close();
+            return false;
+        }
+        data = static_cast<uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, numBytes));
+        if (!data) {
+            close();
+            return false;
+        }
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        if (ftruncate(fd, numBytes) != 0) {
+            close();
+            return false;
+        }
+        void* mapped = mmap(nullptr, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close();
+            return false;
+        }
+        data = static_cast<uint8_t*>(mapped);
+#endif
+        size = numBytes;
+        return true;
+    }
+
+    // Writes the mapped pages back to the file.
+    void flush() {
+        if (!data)
+            return;
+#ifdef _WIN32
+        FlushViewOfFile(data, 0);
+#else
+        msync(data, size, MS_SYNC);
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mappingHandle)
+            CloseHandle(mappingHandle);
+        if (fileHandle != INVALID_HANDLE_VALUE)
+            CloseHandle(fileHandle);
+        mappingHandle = NULL;
+        fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap(data, size);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    uint8_t* bytes() { return data; }
+    const uint8_t* bytes() const { return data; }
+    size_t sizeInBytes() const { return size; }
+};
+
+//------------------------------------------------------------------------------
+// WFCMappedGrid: Final tile IDs of a grid too large for memory, kept in a
+// memory-mapped file. Cells are stored in BRICK x BRICK bricks (bricks in
+// row-major order, cells row-major inside a brick), so a band of BRICK rows is
+// one contiguous range of the file instead of a slice of every row. A cell
+// holds tileID + 1 in 1, 2 or 4 bytes, so the zeros of a new file read as
+// unset.
+class WFCMappedGrid {
+private:
+    WFCMappedFile file;
+    int width = 0, height = 0;
+    int elementSize = 1;
+    int bricksPerRow = 0;
+
+    size_t offset(int x, int y) const {
+        size_t brick = (size_t)(y / BRICK) * bricksPerRow + x / BRICK;
+        return (brick * BRICK * BRICK + (y % BRICK) * BRICK + x % BRICK) * elementSize;
+    }
+
+public:
+    static constexpr int BRICK = 64;
+
+    // Creates the file for a w x h grid of a set with numTileTypes tiles.
+    bool create(const string& path, int w, int h, int numTileTypes) {
+        width = w;
+        height = h;
+        elementSize = numTileTypes <= 0xFF ? 1 : numTileTypes <= 0xFFFF ? 2 : 4;
+        bricksPerRow = (w + BRICK - 1) / BRICK;
+        size_t bricks = (size_t)bricksPerRow * ((h + BRICK - 1) / BRICK);
+        return file.create(path, bricks * BRICK * BRICK * elementSize);
+    }
+
+    // Tile ID of a cell, or -1 if it is unset.
+    int get(int x, int y) const {
+        const uint8_t* p = file.bytes() + offset(x, y);
+        uint32_t stored = 0;
+        memcpy(&stored, p, elementSize);  // Little-endian: the low bytes hold the value.
+        return (int)stored - 1;
+    }
 
+    void set(int x, int y, int tileID) {
+        uint32_t stored = tileID + 1;
+        memcpy(file.bytes() + offset(x, y), &stored, elementSize);
     }
-} // WFC
\ No newline at end of file
+
+    void flush() { file.flush(); }
+    void close() { file.close(); }
+};
+//------------------------------------------------------------------------------
+// Out-of-core solving.
+bool solveOutOfCore(shared_ptr<const WFCRules> rules, int width, int height, uint64_t seed,
+                    const string& tilesPath, const string& imagePath, int tileSize,
+                    PropagatorMode mode, int bandRows, int backtrackLimit, int maxAttempts) {
+    WFCMappedGrid grid;
+    if (!grid.create(tilesPath, width, height, rules->tileDefinitions.size())) {
+        cerr << "Failed to map file: " << tilesPath << endl;
+        return false;
+    }
+    ofstream image;
+    if (!imagePath.empty()) {
+        image.open(imagePath, ios::binary);
+        if (!image) {
+            cerr << "Failed to open file: " << imagePath << endl;
+            return false;
+        }
+        image << "P6\n" << (size_t)width * tileSize << " " << (size_t)height * tileSize << "\n255\n";
+    }
+    // Neither file is left behind looking complete after a failure.
+    auto fail = [&]() {
+        grid.close();
+        remove(tilesPath.c_str());
+        if (image.is_open()) {
+            image.close();
+            remove(imagePath.c_str());
+        }
+        return false;
+    };
+    vector<unsigned char> scanline((size_t)width * tileSize * 3);
+    vector<int> border;  // Last row of the previous band.
+
+    for (int y0 = 0, band = 0; y0 < height; y0 += bandRows, band++) {
+        int rows = min(bandRows, height - y0);
+        // The band is solved with overlap rows below it that are dropped, so
+        // that its last row, the next band's border, can be continued.
+        int overlap = min(max(1, bandRows / 4), height - y0 - rows);
+        unique_ptr<WFC> wfc;
+        for (int attempt = 0; attempt < maxAttempts && !wfc; attempt++) {
+            uint64_t bandSeed = WFCRandom::mix(WFCRandom::mix(seed + band) + attempt);
+            auto candidate = WFC::create(width, rows + overlap, tileSize, rules, mode, bandSeed);
+            candidate->setBacktrackLimit(backtrackLimit);
+            for (int x = 0; x < (int)border.size(); x++)
+                candidate->constrainCell(x, 0, rules->adjacency.row(SOUTH, border[x]));
+            candidate->propagate();
+            if (candidate->run())
+                wfc = move(candidate);
+        }
+        if (!wfc) {
+            cerr << "Failed to solve rows " << y0 << " to " << y0 + rows - 1
+                 << "; removed the incomplete output." << endl;
+            return fail();
+        }
+
+        for (int y = 0; y < rows; y++)
+            for (int x = 0; x < width; x++)
+                grid.set(x, y0 + y, wfc->tileAt(x, y));
+        wfc.reset();
+        // The border and the image are read back from the file.
+        border.resize(width);
+        for (int x = 0; x < width; x++)
+            border[x] = grid.get(x, y0 + rows - 1);
+
+        if (image.is_open()) {
+            for (int y = y0; y < y0 + rows; y++) {
+                for (int x = 0; x < width; x++) {
+                    const WFCTileDefinition& def = rules->tileDefinitions[grid.get(x, y)];
+                    for (int tx = 0; tx < tileSize; tx++) {
+                        unsigned char* pixel = &scanline[((size_t)x * tileSize + tx) * 3];
+                        pixel[0] = def.r;
+                        pixel[1] = def.g;
+                        pixel[2] = def.b;
+                    }
+                }
+                for (int ty = 0; ty < tileSize; ty++)
+                    image.write(reinterpret_cast<const char*>(scanline.data()), scanline.size());
+            }
+        }
+    }
+    grid.flush();
+    if (image.is_open()) {
+        image.close();
+        if (!image) {
+            cerr << "Error writing image file." << endl;
+            remove(imagePath.c_str());
+            return false;
+        }
+        cout << "Image generated: " << imagePath << endl;
+    }
+    return true;
+}
+
+} // WFC
@@ -1,19 +1,1225 @@
 //
 // Created by Gabriel Dolzan on 4/9/2025.
 //
+// quick_wfc library: rule loading, solving, stepping and image export for the
+// simple tiled Wave Function Collapse model. Everything lives in namespace
+// WFC; the solver class itself is WFC::WFC. Link quick_wfc_static or
+// quick_wfc_shared and include this header.
+//
+// Minimal use:
+//   auto rules = WFC::WFCRules::load("input.wfcin");
+//   auto solver = WFC::WFC::create(20, 20, 32, rules, WFC::PROPAGATE_BITSET, seed);
+//   if (solver->run())
+//       solver->generateImage("output.png");
 
 #ifndef WFC_H
 #define WFC_H
 
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <iosfwd>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <bit>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
 namespace WFC
 {
 
-class WFC
-{
+//------------------------------------------------------------------------------
+// Enum for Directions. The four planar directions come first; UP (toward
+// z + 1) and DOWN only have neighbors in a volume. A hex grid or mesh (see
+// WFCTopology) names its six directions EAST, WEST and the four diagonals,
+// which share the slots of NORTH, SOUTH, UP and DOWN.
+enum Direction {
+    NORTH = 0, EAST = 1, SOUTH = 2, WEST = 3, UP = 4, DOWN = 5,
+    NORTHEAST = NORTH, SOUTHWEST = SOUTH, NORTHWEST = UP, SOUTHEAST = DOWN
+};
+
+// Number of directions the rule tables hold.
+constexpr int NUM_DIRECTIONS = 6;
+
+// Returns the direction pointing back from a neighbor.
+constexpr Direction opposite(Direction dir) {
+    return static_cast<Direction>(dir < UP ? (dir + 2) % 4 : dir ^ 1);
+}
+
+// Calls f(d) for each of the first Directions directions (4 for a plane, 6
+// for a volume), with d a compile-time constant, so that per-direction loops
+// are fully unrolled.
+template <int Directions = 4, typename F>
+inline void forEachDirection(F f) {
+    f(std::integral_constant<Direction, NORTH>());
+    f(std::integral_constant<Direction, EAST>());
+    f(std::integral_constant<Direction, SOUTH>());
+    f(std::integral_constant<Direction, WEST>());
+    if constexpr (Directions == NUM_DIRECTIONS) {
+        f(std::integral_constant<Direction, UP>());
+        f(std::integral_constant<Direction, DOWN>());
+    }
+}
+
+// Helper to convert a direction string (case-insensitive) to Direction enum.
+bool parseDirection(const std::string& dirStr, Direction &dir);
+
+//------------------------------------------------------------------------------
+// Structure for tile definitions.
+struct WFCTileDefinition {
+    std::string name;
+    int r, g, b;
+    double weight = 1.0;           // Relative frequency of the tile.
+    double weightLogWeight = 0.0;  // weight * log(weight), cached for entropy updates.
+};
+
+//------------------------------------------------------------------------------
+// WFCWordKernels: Word-array kernels behind wide domains (DOMAIN_WIDE):
+// computing the union of the adjacency rows of a domain's tiles, and checking
+// whether an intersection would remove any tile. They are the inner loop of
+// bitset propagation for large tile sets, so there are AVX2 and AVX-512
+// versions, picked at runtime from the CPU features, next to a portable
+// scalar fallback.
+struct WFCWordKernels {
+    const char* name;
+    // out = OR of rows[t * numWords .. (t + 1) * numWords) over the tiles t set in domain.
+    void (*unionOfRows)(uint64_t* out, const uint64_t* rows, const uint64_t* domain, int numWords);
+    // Whether dst & ~src has any bit set.
+    bool (*removesAny)(const uint64_t* dst, const uint64_t* src, int numWords);
+
+    // Kernels used by the solver: the fastest set the CPU supports, unless
+    // select() picked another one.
+    static const WFCWordKernels& active() { return *current(); }
+
+    // Selects a kernel set by name ("scalar", "avx2" or "avx512"). Returns
+    // false if it is unknown or not supported by this CPU. Not thread-safe;
+    // call it before starting solvers.
+    static bool select(const std::string& kernelName);
+
+    // Names of the kernel sets this CPU supports, fastest first.
+    static std::vector<std::string> available();
+
+private:
+    static const WFCWordKernels*& current();
+};
+
+//------------------------------------------------------------------------------
+// WFCAdjacency: Compatibility bit-matrix compiled from the constraints.
+// For each direction d and tile t, row(d, t) has bit n set when tile n may be
+// placed in direction d of tile t. The matrix is kept symmetric, so
+// allows(d, t, n) == allows(opposite(d), n, t).
+class WFCAdjacency {
+private:
+    int numTiles = 0;
+    int wordsPerRow = 0;
+    std::vector<uint64_t> rows;  // [direction][tile][word]
+
+public:
+    // Compiles the matrix from the per-direction allowed lists declared for
+    // each tile. A pair is compatible only if both tiles allow each other.
+    void compile(int numTileTypes, const std::vector<std::vector<bool>> (&declared)[NUM_DIRECTIONS]) {
+        reset(numTileTypes);
+        for (int d = 0; d < NUM_DIRECTIONS; d++) {
+            Direction back = opposite(static_cast<Direction>(d));
+            for (int t = 0; t < numTiles; t++) {
+                uint64_t* r = &rows[((size_t)d * numTiles + t) * wordsPerRow];
+                for (int n = 0; n < numTiles; n++)
+                    if (declared[d][t][n] && declared[back][n][t])
+                        r[n >> 6] |= 1ull << (n & 63);
+            }
+        }
+    }
+
+    // Sizes the matrix for numTileTypes tiles, with no compatible pair.
+    void reset(int numTileTypes) {
+        numTiles = numTileTypes;
+        wordsPerRow = (numTiles + 63) / 64;
+        rows.assign((size_t)NUM_DIRECTIONS * numTiles * wordsPerRow, 0);
+    }
+
+    // Makes every pair compatible in direction dir and, symmetrically, in the
+    // opposite direction. Rules learned from 2D sources say nothing about UP
+    // and DOWN, so they leave the layers of a volume independent this way.
+    void allowAll(Direction dir) {
+        for (Direction d : { dir, opposite(dir) })
+            for (int t = 0; t < numTiles; t++) {
+                uint64_t* r = row(d, t);
+                for (int i = 0; i < wordsPerRow; i++)
+                    r[i] = ~0ull;
+                if (numTiles & 63)
+                    r[wordsPerRow - 1] = (1ull << (numTiles & 63)) - 1;
+            }
+    }
+
+    // Marks neighborID as allowed in direction dir of tileID, and tileID in
+    // the opposite direction of neighborID, which keeps the matrix symmetric.
+    void allow(Direction dir, int tileID, int neighborID) {
+        rows[((size_t)dir * numTiles + tileID) * wordsPerRow + (neighborID >> 6)] |= 1ull << (neighborID & 63);
+        rows[((size_t)opposite(dir) * numTiles + neighborID) * wordsPerRow + (tileID >> 6)] |= 1ull << (tileID & 63);
+    }
+
+    int numWords() const { return wordsPerRow; }
+
+    const uint64_t* row(Direction dir, int tileID) const {
+        return &rows[((size_t)dir * numTiles + tileID) * wordsPerRow];
+    }
+
+    uint64_t* row(Direction dir, int tileID) {
+        return &rows[((size_t)dir * numTiles + tileID) * wordsPerRow];
+    }
+
+    // Checks whether neighborID may be placed in direction dir of tileID.
+    bool allows(Direction dir, int tileID, int neighborID) const {
+        return (row(dir, tileID)[neighborID >> 6] >> (neighborID & 63)) & 1;
+    }
+
+    // Calls f(neighborID) for each tile allowed in direction dir of tileID.
+    template <typename F>
+    void forEachAllowed(Direction dir, int tileID, F f) const {
+        const uint64_t* r = row(dir, tileID);
+        for (int i = 0; i < wordsPerRow; i++) {
+            uint64_t bits = r[i];
+            while (bits) {
+                f(i * 64 + std::countr_zero(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    // Number of tiles allowed in direction dir of tileID.
+    int countAllowed(Direction dir, int tileID) const {
+        const uint64_t* r = row(dir, tileID);
+        int total = 0;
+        for (int i = 0; i < wordsPerRow; i++)
+            total += std::popcount(r[i]);
+        return total;
+    }
+};
+
+//------------------------------------------------------------------------------
+// WFCSample: Example image for the overlapping model, as packed 0xRRGGBB
+// pixels in row-major order.
+struct WFCSample {
+    int width = 0, height = 0;
+    std::vector<uint32_t> pixels;
+
+    // Loads a PPM image, binary (P6) or text (P3), with at most 8 bits per
+    // channel.
+    bool load(const std::string &filename);
+};
+
+//------------------------------------------------------------------------------
+// WFCRules: Tile definitions and the compiled adjacency matrix of a tile set.
+// A rule set is not modified after loading, so one instance can be shared by
+// any number of solvers, including solvers running on different threads.
+class WFCRules {
+public:
+    std::vector<WFCTileDefinition> tileDefinitions;        // Tile definitions (name, color).
+    std::map<std::string, int> tileNameToID;               // Mapping from tile name to tile ID.
+    WFCAdjacency adjacency;                                // Compiled neighbor compatibility matrix.
+    bool uniformWeights = true;                            // Whether every tile has the same weight.
+
+    // Loads and compiles a .wfcin file, or loads a binary rule file written
+    // by saveBinary(). Returns nullptr if it cannot be loaded.
+    static std::shared_ptr<const WFCRules> load(const std::string &filename);
+
+    // Builds the rules of the overlapping model from a sample image: every
+    // patternSize x patternSize block of the sample, and of up to symmetry - 1
+    // of its reflections and rotations, becomes a tile weighted by how often
+    // it occurs. Two tiles may be neighbors when their blocks agree where
+    // they overlap after a one-pixel shift. A tile is drawn with the color of
+    // its block's top-left pixel, so a solved grid renders as an image like
+    // the sample. symmetry is 1 (the sample only), 2 (plus its mirror
+    // image), up to 8 (every rotation and reflection). Returns nullptr if the
+    // sample is smaller than one block.
+    static std::shared_ptr<const WFCRules> fromSample(const WFCSample& sample, int patternSize, int symmetry = 8);
+
+    // Parses a .wfcin input file.
+    // Expected file structure:
+    //   [WFINPUT]
+    //   [Tiles]
+    //   Red 255 0 0
+    //   Green 0 255 0 2.5
+    //   Blue 0 0 255
+    //
+    // A tile line may end with an optional weight (default 1), the relative
+    // frequency with which the tile is chosen when a cell collapses, and an
+    // optional symmetry class:
+    //   X  fully symmetric (+)                  1 orientation
+    //   I  straight, running NORTH-SOUTH (|)    2 orientations
+    //   \  diagonal (\)                         2 orientations
+    //   T  T-junction with its stem SOUTH       4 orientations
+    //   L  corner joining NORTH and EAST        4 orientations
+    //   F  no symmetry                          8 orientations
+    // Such a tile expands into one tile per orientation: "Road" for the base
+    // and "Road:1".. for each further clockwise quarter turn (F adds the
+    // mirrored base as "Road:4" and its turns). Constraint lines for a tile
+    // with a symmetry class are written for any one orientation and are
+    // rotated and reflected into the others automatically; allowed tiles
+    // without a class are treated as fully symmetric there. For example, with
+    // "Road 128 128 128 I" the line "Road NORTH Road" also lets Road:1 sit
+    // EAST of Road:1.
+    //
+    //   [Constraints]
+    //   Red NORTH Green Blue
+    //   Red EAST Blue
+    //   Green SOUTH Red Blue
+    //   Green WEST Red Blue
+    //   Blue NORTH Red
+    //   Blue EAST Green
+    //
+    // Volumes (WFC::createVolume()) also read UP and DOWN lines. A tile with
+    // no line for a direction accepts every tile there.
+    // Lines starting with '#' or ';' are treated as comments.
+    bool loadFromFile(const std::string &filename);
+
+    // Loads a binary rule file: the tile definitions and the compiled
+    // adjacency matrix as they are in memory, so nothing is parsed or
+    // compiled. The layout is the "WFCR" magic, a version and the tile count
+    // (uint32), then per tile the name length (uint32), the name, r, g, b
+    // (uint8) and the weight (double), then the adjacency rows (uint64),
+    // all in the machine's byte order.
+    bool loadFromBinaryFile(const std::string &filename);
+
+    // Writes the rules as a .wfcin file, with a constraint line for every
+    // tile and direction, except UP and DOWN lines that would allow every tile.
+    bool saveText(const std::string &filename) const;
+
+    // Writes the rules as a binary rule file (see loadFromBinaryFile()).
+    bool saveBinary(const std::string &filename) const;
+};
+
+//------------------------------------------------------------------------------
+// WFCRuleLearner: Learns the rules of a tiled model from example tilemaps.
+// Every pair of neighbors seen in an example is allowed in the learned
+// adjacency, and every tile is weighted by the number of times it occurs.
+// Maps are streamed one row at a time, so examples of any size are learned
+// in a single pass in memory proportional to the map width.
+//
+// A text map has one row of whitespace-separated tile names per line; a
+// blank line ends a map, and lines starting with '#' are comments. A binary
+// map file holds one or more maps, each the "WFCM" magic, then the width,
+// the height and the bytes per cell (1, 2 or 4) as uint32, then the tile IDs
+// row by row, all in the machine's byte order.
+class WFCRuleLearner {
+private:
+    std::vector<WFCTileDefinition> tiles;               // Tiles, with the weight counting occurrences.
+    std::unordered_map<std::string, int> tileIDs;       // Mapping from tile name to index in tiles.
+    bool fixedTiles;                                    // Whether the tiles come from a tile set.
+    std::vector<std::vector<uint64_t>> seen[2];         // [EAST, SOUTH][tile] bitset of neighbors seen.
+    std::vector<int> previousRow, currentRow;           // Tile IDs of the last two rows of a map.
+
+    int tileID(const std::string &name);
+    void observe(int dir, int tileID, int neighborID);
+    // Counts the tiles of currentRow and the pairs it forms with itself and
+    // with previousRow, if the row continues the same map.
+    bool addRow(bool continuesMap, const std::string &source);
+    bool addTextMaps(std::istream &in, const std::string &source);
+    bool addBinaryMaps(std::istream &in, const std::string &source);
+
+public:
+    // Learns rules over the tiles (names and colors) of tileSet, or over
+    // tiles named after the examples if tileSet is null. Binary maps need a
+    // tile set, or name their tiles "tile<ID>".
+    explicit WFCRuleLearner(std::shared_ptr<const WFCRules> tileSet = nullptr);
+
+    // Adds the example maps of a file, text or binary.
+    bool addFile(const std::string &filename);
+
+    // Rules learned so far. Tiles that were never seen are left out.
+    std::shared_ptr<const WFCRules> rules() const;
+};
+
+//------------------------------------------------------------------------------
+// WFCTopology: Cells and the directed edges between them, for solving on
+// grids other than the square one. The edges leaving cell c are
+// [edgeStart[c], edgeStart[c + 1]): edge e leads to edgeTarget[e], which
+// must hold a tile allowed in direction edgeDirection[e] of the cell's tile.
+// Every edge has a reverse edge with the opposite direction. Positions place
+// the cells in the image, in tiles from the top left corner.
+//
+// The square grid uses NORTH, EAST, SOUTH and WEST. The hex grid has rows of
+// pointy-top hexes, the odd rows shifted half a hex to the east, and uses
+// EAST, WEST and the diagonals. The triangle grid alternates up and down
+// triangles along each row, (x + y) even pointing up; each has EAST and WEST
+// neighbors, and SOUTH for an up triangle or NORTH for a down one. Cells are
+// numbered row by row.
+class WFCTopology {
+private:
+    void addEdge(int target, Direction dir) {
+        edgeTarget.push_back(target);
+        edgeDirection.push_back(dir);
+    }
+    // Ends the edges of the current cell and places it.
+    void endCell(double x, double y);
+    // Computes the derived fields once every cell has been added.
+    void finish();
+
+public:
+    std::vector<int> edgeStart = { 0 };          // [cell + 1] first edge of each cell, then the edge count.
+    std::vector<int> edgeTarget;                 // [edge] cell the edge leads to.
+    std::vector<uint8_t> edgeDirection;          // [edge] Direction of the edge.
+    std::vector<double> positionX, positionY;    // [cell] position of the cell's top left corner.
+    int columns = 0, rows = 0;                   // Image size in tiles.
+    int bandwidth = 1;                           // Largest distance between the numbers of two linked cells.
+    bool uniqueDirections = true;                // No cell has two edges with the same direction.
+
+    int numCells() const { return (int)edgeStart.size() - 1; }
+
+    static std::shared_ptr<const WFCTopology> square(int w, int h);
+    static std::shared_ptr<const WFCTopology> hex(int w, int h);
+    static std::shared_ptr<const WFCTopology> triangle(int w, int h);
+
+    // Loads the faces of a Wavefront OBJ mesh as cells, two faces being
+    // linked when they share an edge. The direction of an edge is the sector,
+    // out of directions (4 or 6) around the face's centroid in the x-y plane,
+    // that the linked face's centroid lies in: EAST is +x and NORTH +y, or
+    // with 6 sectors EAST, NORTHEAST, NORTHWEST, WEST, SOUTHWEST and SOUTHEAST.
+    // Cells are numbered in rows of centroids, for locality. Returns nullptr
+    // if the file cannot be read or has no faces.
+    static std::shared_ptr<const WFCTopology> loadMesh(const std::string& filename, int directions = 4);
+};
+
+//------------------------------------------------------------------------------
+// WFCCellHeap: Indexed binary min-heap of the cells that are left to collapse,
+// keyed by their entropy. position[cell] locates each cell in
+// the heap, so its key can be updated in O(log N) whenever propagation shrinks
+// its domain and the next cell to collapse is always at the top.
+class WFCCellHeap {
+private:
+    struct Entry {
+        double key;
+        int cell;
+    };
+    std::vector<Entry> heap;
+    std::vector<int> position;  // Index of each cell in heap, or -1 if absent.
+
+    // Ties are broken by cell index, so the top is the cell with the lowest
+    // index among those with the lowest key.
+    static bool less(const Entry& a, const Entry& b) {
+        return a.key < b.key || (a.key == b.key && a.cell < b.cell);
+    }
+
+    void place(int i, const Entry& e) {
+        heap[i] = e;
+        position[e.cell] = i;
+    }
+
+    void siftUp(int i) {
+        Entry e = heap[i];
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (!less(e, heap[parent]))
+                break;
+            place(i, heap[parent]);
+            i = parent;
+        }
+        place(i, e);
+    }
+
+    void siftDown(int i) {
+        Entry e = heap[i];
+        int n = heap.size();
+        while (true) {
+            int child = 2 * i + 1;
+            if (child >= n)
+                break;
+            if (child + 1 < n && less(heap[child + 1], heap[child]))
+                child++;
+            if (!less(heap[child], e))
+                break;
+            place(i, heap[child]);
+            i = child;
+        }
+        place(i, e);
+    }
+
+public:
+    // Fills the heap with cells [0, numCells), all with the same key.
+    void reset(int numCells, double key) {
+        heap.resize(numCells);
+        position.resize(numCells);
+        for (int cell = 0; cell < numCells; cell++)
+            place(cell, Entry{ key, cell });
+    }
+
+    bool empty() const { return heap.empty(); }
+    bool contains(int cell) const { return position[cell] >= 0; }
+    int top() const { return heap[0].cell; }
+
+    // Inserts a cell that is not in the heap, or updates its key.
+    void insertOrUpdate(int cell, double key) {
+        if (position[cell] < 0) {
+            heap.push_back(Entry{ key, cell });
+            position[cell] = heap.size() - 1;
+            siftUp(heap.size() - 1);
+        } else {
+            update(cell, key);
+        }
+    }
+
+    void update(int cell, double key) {
+        int i = position[cell];
+        if (i < 0)
+            return;
+        double old = heap[i].key;
+        heap[i].key = key;
+        if (key < old)
+            siftUp(i);
+        else
+            siftDown(i);
+    }
+
+    void remove(int cell) {
+        int i = position[cell];
+        if (i < 0)
+            return;
+        position[cell] = -1;
+        Entry last = heap.back();
+        heap.pop_back();
+        if (i == (int)heap.size())
+            return;
+        place(i, last);
+        siftUp(i);
+        siftDown(position[last.cell]);
+    }
+};
+
+//------------------------------------------------------------------------------
+// WFCTileIndexBuffer: Per-cell tile IDs stored in the narrowest unsigned type
+// that holds every tile ID of the set plus an "unset" marker (the type's
+// maximum value): one byte per cell for up to 255 tiles, two bytes for up to
+// 65535 tiles and four bytes beyond that. Unset cells read back as -1.
+class WFCTileIndexBuffer {
+private:
+    std::vector<uint8_t> bytes;
+    int elementSize = 1;
+
+public:
+    // Sizes the buffer for count cells of a set with numTileTypes tiles, all unset.
+    void reset(size_t count, int numTileTypes) {
+        elementSize = numTileTypes <= 0xFF ? 1 : numTileTypes <= 0xFFFF ? 2 : 4;
+        bytes.assign(count * elementSize, 0xFF);
+    }
+
+    int get(size_t i) const {
+        switch (elementSize) {
+        case 1: {
+            uint8_t v = bytes[i];
+            return v == 0xFF ? -1 : v;
+        }
+        case 2: {
+            uint16_t v;
+            std::memcpy(&v, &bytes[i * 2], sizeof(v));
+            return v == 0xFFFF ? -1 : v;
+        }
+        default: {
+            int32_t v;
+            std::memcpy(&v, &bytes[i * 4], sizeof(v));
+            return v;
+        }
+        }
+    }
+
+    void set(size_t i, int tileID) {
+        switch (elementSize) {
+        case 1:
+            bytes[i] = static_cast<uint8_t>(tileID);
+            break;
+        case 2: {
+            uint16_t v = static_cast<uint16_t>(tileID);
+            std::memcpy(&bytes[i * 2], &v, sizeof(v));
+            break;
+        }
+        default: {
+            int32_t v = tileID;
+            std::memcpy(&bytes[i * 4], &v, sizeof(v));
+            break;
+        }
+        }
+    }
+
+    size_t sizeInBytes() const { return bytes.size(); }
+};
+
+//------------------------------------------------------------------------------
+// WFCRandom: xoshiro256** pseudo-random generator with an explicit 64-bit
+// seed. Each solver owns one, so runs are reproducible from their seed and
+// concurrent solvers never contend on shared state. jump() advances by 2^128
+// draws, which splits one seed into non-overlapping streams for parallel
+// workers.
+class WFCRandom {
+private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    // Expands the seed into the 256-bit state with splitmix64.
+    explicit WFCRandom(uint64_t seed) {
+        for (int i = 0; i < 4; i++)
+            s[i] = mix(seed += 0x9e3779b97f4a7c15ull);
+    }
+
+    // splitmix64 finalizer: scrambles a 64-bit value, e.g. to derive
+    // independent seeds from structured inputs such as coordinates.
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Uniform double in [0, 1).
+    double nextDouble() { return (next() >> 11) * 0x1.0p-53; }
+
+    // Uniform integer in [0, n), without modulo bias (Lemire's method).
+    uint32_t nextBelow(uint32_t n) {
+        uint64_t m = (next() >> 32) * n;
+        uint32_t low = static_cast<uint32_t>(m);
+        if (low < n) {
+            uint32_t threshold = -n % n;
+            while (low < threshold) {
+                m = (next() >> 32) * n;
+                low = static_cast<uint32_t>(m);
+            }
+        }
+        return static_cast<uint32_t>(m >> 32);
+    }
+
+    // Advances the state by 2^128 draws.
+    void jump() {
+        static const uint64_t JUMP[] = { 0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull,
+                                         0xa9582618e03fc9aaull, 0x39abdc4529b1661cull };
+        uint64_t t[4] = { 0, 0, 0, 0 };
+        for (uint64_t word : JUMP)
+            for (int b = 0; b < 64; b++) {
+                if (word & (1ull << b))
+                    for (int i = 0; i < 4; i++)
+                        t[i] ^= s[i];
+                next();
+            }
+        for (int i = 0; i < 4; i++)
+            s[i] = t[i];
+    }
+
+    // Returns the current stream and moves this generator to the next one.
+    WFCRandom split() {
+        WFCRandom stream = *this;
+        jump();
+        return stream;
+    }
+};
+
+//------------------------------------------------------------------------------
+// Propagation strategies, selectable at runtime.
+//   PROPAGATE_BITSET: worklist of cells whose domain shrank. Each pop ORs the
+//     adjacency rows of the cell's domain and intersects every neighbor with
+//     the result. Needs no state beyond the domains, but every pop costs
+//     O(T * T / 64) for T tiles.
+//   PROPAGATE_AC4: keeps, per cell, tile and direction, the number of tiles
+//     still possible in that neighbor which support the tile. Removing a tile
+//     only decrements the counters of the tiles compatible with it, and a tile
+//     is removed when one of its counters reaches zero. Costs an extra
+//     4 * T * sizeof(uint16_t) bytes per cell (6 * T in a volume), in
+//     exchange for work that is proportional to the removals, which pays off
+//     for large tile sets.
+enum PropagatorMode { PROPAGATE_BITSET = 0, PROPAGATE_AC4 = 1 };
+
+// Helper to convert a propagator name ("bitset" or "ac4") to PropagatorMode.
+bool parsePropagatorMode(const std::string& name, PropagatorMode &mode);
+
+//------------------------------------------------------------------------------
+// Domain widths the solver core is instantiated for. DOMAIN_8 to DOMAIN_64
+// hold a cell's domain in a single word of that many bits, DOMAIN_WIDE in as
+// many 64-bit words as the tile set needs. DOMAIN_AUTO picks the narrowest
+// width that fits the tile set.
+enum DomainWidth { DOMAIN_AUTO = 0, DOMAIN_8 = 8, DOMAIN_16 = 16, DOMAIN_32 = 32, DOMAIN_64 = 64, DOMAIN_WIDE = -1 };
+
+// Narrowest domain width that holds numTiles tiles.
+DomainWidth narrowestDomainWidth(int numTiles);
+
+// Returns the name of a domain width, e.g. "8" or "wide".
+std::string domainWidthName(DomainWidth width);
+
+// Helper to convert a domain width name ("auto", "8", "16", "32", "64" or
+// "wide") to DomainWidth.
+bool parseDomainWidth(const std::string& name, DomainWidth &width);
+
+//------------------------------------------------------------------------------
+// WFC: Core class that holds the grid and the tile definitions, and runs the
+// algorithm. The grid is stored as flat structure-of-arrays buffers indexed by
+// cell = y * width + x, one buffer per field, so propagation walks contiguous
+// memory instead of chasing per-row and per-cell allocations.
+// A volume (createVolume()) is stored in the same buffers, but cut into
+// bricks of 4 x 4 x 4 cells, each brick 64 consecutive cells and the bricks in
+// x, y, z order. A cell's six neighbors then mostly share its brick, and so
+// its cache lines, where plain row-major order would put the UP and DOWN
+// neighbors a whole slice away. Volumes that are not a whole number of bricks
+// are padded; padding cells start out collapsed and have no neighbors.
+// The domain bitsets and the code that touches them live in WFCSolver, which
+// is instantiated for each domain width and layout; create() and
+// createVolume() pick the instantiation.
+class WFC {
+protected:
+    std::shared_ptr<const WFCRules> rules;                 // Shared, immutable rule set.
+    const std::vector<WFCTileDefinition>& tileDefinitions;
+    const WFCAdjacency& adjacency;
+    uint64_t seed;                                         // Seed the solver was created with.
+    WFCRandom rng;                                         // Per-solver random number generator.
+    const std::atomic<bool>* cancelFlag;                   // Stops run() when set; may be null.
+
+    int width, height, depth;
+    int tileSize;  // Pixel size for output image tiles.
+    PropagatorMode propagatorMode;
+    int numCells;  // Cells in the buffers, padding included.
+
+    // Planar layout: offsets to the neighbor in each direction, in
+    // coordinates and in cells.
+    static constexpr int dx[4] = { 0, 1, 0, -1 };
+    static constexpr int dy[4] = { -1, 0, 1, 0 };
+    int neighborOffset[4];
+
+    // How cells are laid out in the buffers and find their neighbors.
+    enum GridLayout { LAYOUT_PLANAR, LAYOUT_VOLUME, LAYOUT_GRAPH };
+    const GridLayout layout;
+
+    // Volume layout. Graphs use neighborMasks too, without padding.
+    static constexpr uint8_t PADDING_CELL = 0x80;
+    int bricksX, bricksY, bricksZ;               // Bricks along each axis.
+    std::vector<uint8_t> neighborMasks;          // [cell] bit d set if the cell has a neighbor in
+                                                 // direction d, or PADDING_CELL.
+
+    // Graph layout: cell c is at (c, 0) of a numCells x 1 grid.
+    std::shared_ptr<const WFCTopology> topology;
+
+    // Per-cell state.
+    std::vector<uint8_t> collapsedFlags;         // [cell] whether the cell has been collapsed.
+    WFCTileIndexBuffer finalTiles;               // [cell] final tile type ID (if collapsed), or -1.
+    std::vector<double> sumWeights;              // [cell] sum of w over the possibilities.
+    std::vector<double> sumWeightLogWeights;     // [cell] sum of w * log(w) over the possibilities.
+
+    // [tile] w and w * log(w), rounded to multiples of a power of two small
+    // enough that every sum of them is exact (see snapWeights()). The cached
+    // sums then do not depend on the order tiles are removed and put back in,
+    // so parallel propagation and backtracking reach the same sums, and the
+    // same entropies, as a single thread.
+    std::vector<double> weights, weightLogWeights;
+
+    WFCCellHeap cellHeap;   // Uncollapsed cells with at least one possibility.
+    int uncollapsedCells;   // Cells not collapsed yet, kept up to date by collapse and propagation.
+    bool contradiction;     // Set once a cell has run out of possibilities.
+
+    // PROPAGATE_BITSET state.
+    std::vector<int> worklist;      // Cells whose domain shrank and must be propagated.
+    std::vector<uint8_t> queued;    // Whether a cell is currently in the worklist (bytes, so that
+                                    // parallel propagation can flag cells of different regions).
+    int propagationThreads;         // Worker threads for large propagation cascades.
+
+    // PROPAGATE_AC4 state.
+    std::vector<uint16_t> supportCounts;          // [cell][tile][direction] supporting tiles left in the neighbor.
+    std::vector<std::pair<int, int>> removals;    // (cell, tile) removals not yet propagated.
+
+    // Backtracking state. Every removal made after the first decision is
+    // recorded on the trail; a decision remembers the trail size before it,
+    // so undoing it means restoring the removals recorded since.
+    struct Decision {
+        size_t trailSize;   // Trail size before the decision was made.
+        int cell;           // Cell that was collapsed.
+        int tileID;         // Tile it was collapsed to.
+    };
+    int backtrackLimit;                           // Maximum number of backtracks; 0 disables backtracking.
+    int backtracks;                               // Backtracks done so far.
+    std::vector<std::pair<int, int>> trail;       // (cell, tile) removals, in order.
+    std::vector<Decision> decisions;              // Open decisions, most recent last.
+
+    void enqueue(int cell) {
+        if (!queued[cell]) {
+            queued[cell] = true;
+            worklist.push_back(cell);
+        }
+    }
+
+    bool hasNeighbor(int cell, int d) const {
+        int x = cell % width + dx[d], y = cell / width + dy[d];
+        return x >= 0 && x < width && y >= 0 && y < height;
+    }
+
+    // Buffer index of the cell at (x, y, z).
+    int cellIndex(int x, int y, int z) const {
+        if (layout != LAYOUT_VOLUME)
+            return y * width + x;
+        int brick = ((z >> 2) * bricksY + (y >> 2)) * bricksX + (x >> 2);
+        return brick * 64 + ((z & 3) << 4 | (y & 3) << 2 | (x & 3));
+    }
+
+    // Volume layout: the neighbor of a cell in direction d, which must have
+    // one (neighborMasks). Within a brick the cell's local index is
+    // z * 16 + y * 4 + x, so a step stays inside the brick unless the local
+    // coordinate is on the brick's face, where it moves to the next brick.
+    int volumeNeighbor(int cell, Direction d) const {
+        int local = cell & 63;
+        int brickRow = bricksX * 64, brickLayer = bricksX * bricksY * 64;
+        switch (d) {
+        case EAST:  return (local & 3) != 3 ? cell + 1 : cell + 64 - 3;
+        case WEST:  return (local & 3) != 0 ? cell - 1 : cell - 64 + 3;
+        case SOUTH: return (local & 12) != 12 ? cell + 4 : cell + brickRow - 12;
+        case NORTH: return (local & 12) != 0 ? cell - 4 : cell - brickRow + 12;
+        case UP:    return (local & 48) != 48 ? cell + 16 : cell + brickLayer - 48;
+        default:    return (local & 48) != 0 ? cell - 16 : cell - brickLayer + 48;
+        }
+    }
+
+    // Shannon entropy of a cell's weighted possibilities, computed from the
+    // cached sums: H = log(sum w) - sum(w log w) / sum w.
+    double entropy(int cell) const {
+        return std::log(sumWeights[cell]) - sumWeightLogWeights[cell] / sumWeights[cell];
+    }
+
+    void subtractWeight(int cell, int tileID) {
+        sumWeights[cell] -= weights[tileID];
+        sumWeightLogWeights[cell] -= weightLogWeights[tileID];
+    }
+
+    // Bookkeeping for a tile that was just cleared from a cell's domain:
+    // subtracts it from the cached sums and, once a decision has been made,
+    // records it on the trail. Earlier removals are never undone.
+    void tileRemoved(int cell, int tileID) {
+        subtractWeight(cell, tileID);
+        if (!decisions.empty())
+            trail.emplace_back(cell, tileID);
+    }
+
+    // Marks a cell whose domain holds only tileID as collapsed.
+    void setCollapsed(int cell, int tileID) {
+        collapsedFlags[cell] = 1;
+        finalTiles.set(cell, tileID);
+        uncollapsedCells--;
+    }
+
+    // Sets up the state shared by every domain width and layout. The domains
+    // are initialized by the derived solver.
+    WFC(int w, int h, int d, GridLayout gridLayout, std::shared_ptr<const WFCTopology> graph, int tSize,
+        std::shared_ptr<const WFCRules> ruleSet, PropagatorMode mode, uint64_t solverSeed)
+        : rules(std::move(ruleSet)), tileDefinitions(rules->tileDefinitions), adjacency(rules->adjacency),
+          seed(solverSeed), rng(solverSeed), cancelFlag(nullptr),
+          width(w), height(h), depth(d), tileSize(tSize), propagatorMode(mode), numCells(0),
+          layout(gridLayout), bricksX(0), bricksY(0), bricksZ(0), topology(std::move(graph)),
+          uncollapsedCells(0), contradiction(false), propagationThreads(1),
+          backtrackLimit(0), backtracks(0)
+    {
+        snapWeights();
+        resetGrid(w, h, d, solverSeed);
+    }
+
+    // Fills weights and weightLogWeights from the tile definitions.
+    void snapWeights();
+
+    // Puts the state shared by every domain width back to an empty w x h x d
+    // grid, or the topology's cells, seeded with solverSeed. The buffers keep
+    // their memory.
+    void resetGrid(int w, int h, int d, uint64_t solverSeed);
+
+    // Size of the rendered image in pixels.
+    void imageSize(int& imageWidth, int& imageHeight) const;
+
 public:
-    void wfc();
+    virtual ~WFC() = default;
+
+    // Creates a solver for the grid dimensions, tile size, a shared rule set,
+    // the propagation strategy and the random seed. The solver core is
+    // instantiated for the requested domain width; DOMAIN_AUTO, or a width too
+    // narrow for the tile set, selects the narrowest one that fits. A
+    // dimension below 1 gives an empty grid, which is complete from the start.
+    static std::unique_ptr<WFC> create(int w, int h, int tSize, std::shared_ptr<const WFCRules> ruleSet,
+                                       PropagatorMode mode, uint64_t solverSeed,
+                                       DomainWidth domainWidth = DOMAIN_AUTO);
+
+    // Creates a solver for a w x h x d volume, where tiles also have UP and
+    // DOWN neighbors, with the same arguments otherwise. The image is the
+    // stack of its z layers, z = 0 on top.
+    static std::unique_ptr<WFC> createVolume(int w, int h, int d, int tSize, std::shared_ptr<const WFCRules> ruleSet,
+                                             PropagatorMode mode, uint64_t solverSeed,
+                                             DomainWidth domainWidth = DOMAIN_AUTO);
+
+    // Creates a solver for the cells and edges of a topology, with the same
+    // arguments otherwise. Cell c is addressed as (c, 0). Falls back to the
+    // bitset propagator if some cell has two edges in one direction, which
+    // the ac4 counters cannot tell apart.
+    static std::unique_ptr<WFC> createGraph(std::shared_ptr<const WFCTopology> graph, int tSize,
+                                            std::shared_ptr<const WFCRules> ruleSet,
+                                            PropagatorMode mode, uint64_t solverSeed,
+                                            DomainWidth domainWidth = DOMAIN_AUTO);
+
+    // Creates a solver from an input file, seeded from the current time.
+    // Returns nullptr if the file cannot be loaded.
+    static std::unique_ptr<WFC> create(int w, int h, int tSize, const std::string &inputFile,
+                                       PropagatorMode mode = PROPAGATE_BITSET) {
+        std::shared_ptr<const WFCRules> ruleSet = WFCRules::load(inputFile);
+        if (!ruleSet)
+            return nullptr;
+        return create(w, h, tSize, std::move(ruleSet), mode, static_cast<uint64_t>(std::time(0)));
+    }
+
+    // Enables backtracking: on a contradiction, run() undoes its most recent
+    // decisions instead of giving up, at most maxBacktracks times in total.
+    // Must be called before run(); 0 disables backtracking.
+    void setBacktrackLimit(int maxBacktracks) { backtrackLimit = maxBacktracks; }
+
+    // Number of backtracks done by run().
+    int backtrackCount() const { return backtracks; }
+
+    // Makes run() return early once *flag becomes true, so that another
+    // thread can cancel the solver.
+    void setCancelFlag(const std::atomic<bool>* flag) { cancelFlag = flag; }
+
+    // Lets the bitset propagator split large cascades across numThreads
+    // worker threads, each owning a band of rows. The workers are started on
+    // the first large cascade and kept until the solver is destroyed. The
+    // result is the same as with a single thread, weighted tiles included.
+    // Has no effect on the ac4 propagator.
+    void setPropagationThreads(int numThreads) { propagationThreads = std::max(1, numThreads); }
+
+    // Starts over on an empty w x h x d grid with a new seed, keeping the rule
+    // set, the options and the memory of the buffers, so that many grids can
+    // be generated without reallocating. Gives the same result as a new
+    // solver created with these arguments. A solver made by create() stays
+    // planar and only takes d = 1; one made by createGraph() keeps its
+    // topology and ignores w, h and d.
+    virtual void reset(int w, int h, int d, uint64_t solverSeed) = 0;
+
+    void reset(int w, int h, uint64_t solverSeed) { reset(w, h, 1, solverSeed); }
+
+    // Runs the collapse and propagation process until all cells are collapsed.
+    // Returns true if the grid was completed, false on a conflict that could
+    // not be resolved or on cancellation.
+    virtual bool run() = 0;
+
+    // Does one step of run(): collapses the lowest-entropy cell and
+    // propagates, or backtracks after a contradiction. Returns false when
+    // there is nothing left to do, because the grid is complete or because
+    // it failed; isComplete() tells which. Lets callers watch or interleave
+    // the generation.
+    virtual bool step() = 0;
+
+    // Collapses a cell to a random possibility and queues the change for
+    // propagate().
+    virtual void collapseCell(int cell) = 0;
+
+    // Propagates pending changes with the selected strategy. Propagation
+    // stops at the first contradiction and drops the remaining changes.
+    virtual void propagate() = 0;
+
+    // Removes from a cell every tile not set in allowed, a bitset over tile
+    // IDs in 64-bit words laid out like WFCAdjacency::row(), and queues the
+    // change for propagate(). Pins cells to outside constraints before run().
+    virtual void constrainCell(int x, int y, int z, const uint64_t* allowed) = 0;
+
+    void constrainCell(int x, int y, const uint64_t* allowed) { constrainCell(x, y, 0, allowed); }
+
+    // Bytes of per-cell solver state (domains plus propagator state) per cell.
+    virtual double stateBytesPerCell() const = 0;
+
+    // Domain width the solver core was instantiated for.
+    virtual DomainWidth getDomainWidth() const = 0;
+
+    const WFCRules& getRules() const { return *rules; }
+    uint64_t getSeed() const { return seed; }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getDepth() const { return depth; }
+
+    // Final tile type ID of a cell, or -1 if it is not collapsed.
+    int tileAt(int x, int y, int z = 0) const { return finalTiles.get(cellIndex(x, y, z)); }
+
+    // Name of a cell's final tile, looked up in the tile definitions, or an
+    // empty string if the cell is not collapsed.
+    const std::string& tileNameAt(int x, int y, int z = 0) const {
+        static const std::string none;
+        int tileID = tileAt(x, y, z);
+        return tileID >= 0 ? tileDefinitions[tileID].name : none;
+    }
+
+    // Returns true if every cell in the grid is collapsed to a valid tile.
+    bool isComplete() const { return uncollapsedCells == 0 && !contradiction; }
+
+    // Number of cells that are not collapsed yet.
+    int remainingCells() const { return uncollapsedCells; }
+
+    // Returns true if some cell has no possibility left.
+    bool hasContradiction() const { return contradiction; }
+
+    // Generates an image (PNG) based on the final collapsed grid.
+    void generateImage(const std::string& filename);
+
+    // Renders the grid into RGB pixels, (width * tileSize) x (height * depth *
+    // tileSize), row-major, the z layers one below the other. A graph is
+    // (columns * tileSize) x (rows * tileSize), each cell a tile-sized square
+    // at its position. Cells that are not collapsed are grey.
+    void renderImage(std::vector<unsigned char>& image) const;
+};
+
+//------------------------------------------------------------------------------
+// Portfolio solving: races numThreads solvers, each on its own thread, against
+// one shared rule set. The seed is split into one random stream per thread and
+// every attempt draws its solver seed from its thread's stream, so all seeds
+// are distinct and each result can be reproduced from WFC::getSeed(). A solver
+// that runs into a conflict restarts with the next seed of its stream, up to
+// maxAttempts runs per thread. The first solver to complete wins and the
+// cancel flag stops the others. Returns the winning solver, with no cancel
+// flag set so that it can be reset and run again, or nullptr if every
+// attempt failed.
+std::unique_ptr<WFC> solvePortfolio(std::shared_ptr<const WFCRules> rules, int w, int h, int tileSize,
+                                    int numThreads, uint64_t seed, PropagatorMode mode = PROPAGATE_BITSET,
+                                    int backtrackLimit = 0, int maxAttempts = 100,
+                                    DomainWidth domainWidth = DOMAIN_AUTO);
+
+//------------------------------------------------------------------------------
+// Batch generation: produces many grids from one compiled rule set. The jobs
+// run in order on a single solver that is reset between them, so neither the
+// rules nor the solver's buffers are rebuilt per grid. onResult(jobIndex,
+// solver) is called after each run, while the solver still holds the grid.
+// Returns the number of grids that were completed.
+struct WFCBatchJob {
+    int width, height;
+    uint64_t seed;
+};
+
+template <typename F>
+int solveBatch(std::shared_ptr<const WFCRules> rules, const std::vector<WFCBatchJob>& jobs, F onResult,
+               PropagatorMode mode = PROPAGATE_BITSET, int backtrackLimit = 0, int tileSize = 1) {
+    std::unique_ptr<WFC> solver;
+    int completed = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const WFCBatchJob& job = jobs[i];
+        if (!solver) {
+            solver = WFC::create(job.width, job.height, tileSize, rules, mode, job.seed);
+            solver->setBacktrackLimit(backtrackLimit);
+        } else {
+            solver->reset(job.width, job.height, job.seed);
+        }
+        if (solver->run())
+            completed++;
+        onResult(i, *solver);
+    }
+    return completed;
+}
+
+//------------------------------------------------------------------------------
+// WFCThreadPool: Work-stealing thread pool. Every worker owns a deque of
+// tasks; it takes its newest task from the back, and once its deque is empty
+// it steals the oldest task from the front of another worker's deque, so
+// the workers stay busy however uneven the tasks are. A task submitted from
+// a worker goes to that worker's deque, others are spread round-robin.
+class WFCThreadPool {
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex stateLock;
+    std::condition_variable wakeUp;      // Signaled when a task is queued or the pool stops.
+    std::condition_variable allDone;     // Signaled when no task is left.
+    int queuedTasks = 0;                 // Tasks waiting in a deque, guarded by stateLock.
+    int unfinishedTasks = 0;             // Tasks queued or running, guarded by stateLock.
+    bool stopping = false;
+    std::atomic<unsigned> nextWorker{ 0 };
+
+    // Worker index of the current thread in this pool, or -1.
+    static inline thread_local const WFCThreadPool* currentPool = nullptr;
+    static inline thread_local int currentWorker = -1;
+
+    bool take(int self, std::function<void()>& task);
+    void workerLoop(int self);
+
+public:
+    explicit WFCThreadPool(int numThreads);
+    ~WFCThreadPool();
+
+    int numThreads() const { return workers.size(); }
+
+    // Queues a task. Tasks may submit further tasks.
+    void submit(std::function<void()> task);
+
+    // Blocks until every submitted task, including the tasks they submitted,
+    // has finished. Must not be called from a task.
+    void wait();
+};
+
+//------------------------------------------------------------------------------
+// Job scheduling: runs independent generation jobs on a WFCThreadPool. Each
+// job is split into a solve task, which on success submits a render task,
+// which submits a PNG encode task, so solving one job overlaps with rendering
+// and encoding others. Jobs are submitted largest first so that a large job
+// does not start last and hold up the end of the run. Returns one report per
+// job, in job order, with the time spent in each stage and the latency from
+// submission to the PNG being written.
+struct WFCJob {
+    int width, height;
+    uint64_t seed;
+    std::string outputFile;
 };
 
+struct WFCJobReport {
+    bool complete = false;      // Solved and written.
+    double solveMs = 0.0;
+    double renderMs = 0.0;
+    double encodeMs = 0.0;
+    double latencyMs = 0.0;     // From submission to the end of the last stage.
+};
+
+std::vector<WFCJobReport> runJobs(std::shared_ptr<const WFCRules> rules, const std::vector<WFCJob>& jobs,
+                                  int numThreads, int tileSize, PropagatorMode mode = PROPAGATE_BITSET,
+                                  int backtrackLimit = 0);
+
+// Reads jobs, one per line: width height seed output.png. Lines starting
+// with '#' are comments.
+bool loadJobs(const std::string& filename, std::vector<WFCJob>& jobs);
+
+//------------------------------------------------------------------------------
+// WFCWorld: Unbounded world generated in square chunks on demand. A chunk is
+// solved as its own grid, seeded from (world seed, chunk coordinates), with
+// the cells along each edge restricted to the tiles compatible with the
+// bordering edge of a neighbor chunk generated before it. Every chunk keeps a
+// small permanent record (its four edges, which neighbors constrained it and
+// the attempt that succeeded), so its tiles can be evicted and regenerated
+// identically from the same inputs instead of being stored. The sides of a
+// chunk that have no neighbor yet are solved with a margin of extra cells, so
+// that the edges it keeps can be continued. A chunk that still cannot be
+// solved against its neighbors' edges re-solves one of those neighbors with
+// new attempts, keeping the edges other chunks depend on.
+class WFCWorld {
+private:
+    struct ChunkRecord {
+        std::vector<int> edges[4];   // [direction] tile IDs along the edge facing that direction.
+        uint8_t constrainedBy;       // Bit d is set if the neighbor in direction d constrained the chunk.
+        uint8_t pinned;              // Bit d is set if the edge in direction d keeps its tiles (see repair()).
+        int attempt;                 // Attempt whose seed solved the chunk.
+        WFCTileIndexBuffer tiles;    // Row-major tile IDs; empty while evicted.
+        bool resident;
+        bool failed;                 // No attempt solved the chunk; it stays empty.
+    };
+
+    std::shared_ptr<const WFCRules> rules;
+    int chunkSize;
+    uint64_t worldSeed;
+    PropagatorMode propagatorMode;
+    int backtrackLimit;
+    int maxAttempts;
+    std::map<std::pair<int, int>, ChunkRecord> chunks;
+
+    static constexpr int dx[4] = { 0, 1, 0, -1 };
+    static constexpr int dy[4] = { -1, 0, 1, 0 };
+
+    // Seed of a chunk's attempt, derived from the world seed and coordinates
+    // only, so it does not depend on the order chunks are generated in.
+    uint64_t chunkSeed(int cx, int cy, int attempt) const {
+        uint64_t h = WFCRandom::mix(worldSeed ^ 0x9e3779b97f4a7c15ull);
+        h = WFCRandom::mix(h ^ static_cast<uint32_t>(cx));
+        h = WFCRandom::mix(h ^ (static_cast<uint64_t>(static_cast<uint32_t>(cy)) << 32));
+        return WFCRandom::mix(h + attempt);
+    }
+
+    // Position of the i-th cell along the chunk's edge in direction d.
+    void edgeCell(int d, int i, int &x, int &y) const {
+        x = d == WEST ? 0 : d == EAST ? chunkSize - 1 : i;
+        y = d == NORTH ? 0 : d == SOUTH ? chunkSize - 1 : i;
+    }
+
+    // Solves a chunk under the edges of the neighbors in record.constrainedBy
+    // and its own pinned edges, trying attempts [record.attempt,
+    // record.attempt + attempts). Fills in the tiles, the edges and the
+    // attempt that succeeded. Returns false if every attempt failed.
+    bool solve(int cx, int cy, ChunkRecord& record, int attempts);
+
+    // Called when a new chunk cannot be solved against the edges of its
+    // neighbors: re-solves one neighbor at a time with new attempts, its
+    // edges facing chunks generated after it pinned so that they can still
+    // be regenerated, until the chunk can be solved against the neighbor's
+    // new edge. A neighbor that does not help gets its old record back.
+    bool repair(int cx, int cy, ChunkRecord& record);
+
+public:
+    // World of chunkSize x chunkSize chunks. Each chunk gets maxAttempts
+    // seeds, each solved with up to backtrackLimit backtracks.
+    WFCWorld(std::shared_ptr<const WFCRules> ruleSet, int size, uint64_t seed,
+             PropagatorMode mode = PROPAGATE_BITSET, int maxBacktracks = 1000, int attempts = 16)
+        : rules(std::move(ruleSet)), chunkSize(size), worldSeed(seed), propagatorMode(mode),
+          backtrackLimit(maxBacktracks), maxAttempts(attempts) {}
+
+    int getChunkSize() const { return chunkSize; }
+
+    // Generates chunk (cx, cy) if needed, or regenerates it if it was
+    // evicted. Returns false if it cannot be solved against its neighbors;
+    // the failure is remembered, as retrying would fail the same way.
+    bool generate(int cx, int cy);
+
+    // Drops a chunk's tiles, keeping the record needed to regenerate them.
+    void evict(int cx, int cy);
+
+    bool isGenerated(int cx, int cy) const {
+        auto found = chunks.find({ cx, cy });
+        return found != chunks.end() && !found->second.failed;
+    }
+
+    bool isResident(int cx, int cy) const {
+        auto found = chunks.find({ cx, cy });
+        return found != chunks.end() && found->second.resident;
+    }
+
+    // Tile ID at world coordinates, generating its chunk if needed, or -1 if
+    // the chunk cannot be generated.
+    int tileAt(long long x, long long y);
+
+    // Generates the chunks [cx0, cx1] x [cy0, cy1] and writes them as a PNG.
+    // Returns false if the image cannot be written or if some chunk could
+    // not be generated, in which case its cells are grey.
+    bool generateImage(const std::string& filename, int cx0, int cy0, int cx1, int cy1, int tileSize);
+};
+
+//------------------------------------------------------------------------------
+// Out-of-core solving: solves a width x height grid as a sliding window of
+// bandRows rows, so that solver state is only held for one band at a time.
+// Each band is a separate solve whose top row is restricted to the tiles
+// allowed below the last row of the previous band, with seeds derived from
+// (seed, band, attempt). A band is solved with a few overlap rows below it
+// that are dropped, so that its last row can be continued by the next band.
+// Final tiles go to tilesPath, as tile ID + 1 in 64 x 64 bricks
+// (WFCMappedGrid in WFC.cpp), so the default band is one brick high. If
+// imagePath is not empty the image is streamed to it as a binary PPM, one
+// band at a time, since PNG encoding would need the whole image in memory.
+// Returns false if a band cannot be solved in maxAttempts attempts, after
+// removing both files.
+bool solveOutOfCore(std::shared_ptr<const WFCRules> rules, int width, int height, uint64_t seed,
+                    const std::string& tilesPath, const std::string& imagePath, int tileSize = 1,
+                    PropagatorMode mode = PROPAGATE_BITSET, int bandRows = 64,
+                    int backtrackLimit = 1000, int maxAttempts = 16);
+
 } // WFC
 
 #endif //WFC_H
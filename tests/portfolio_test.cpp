@@ -0,0 +1,42 @@
+// Checks that the winner of solvePortfolio() can be reset and run again once
+// the portfolio has returned, and that the rerun gives the same grid as the
+// portfolio did for the winning seed.
+// Usage: wfc_portfolio_test <rules.wfcin>
+
+#include "WFC.h"
+
+#include <iostream>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <rules.wfcin>" << std::endl;
+        return 2;
+    }
+    auto rules = WFC::WFCRules::load(argv[1]);
+    if (!rules) {
+        std::cerr << "Could not load " << argv[1] << std::endl;
+        return 2;
+    }
+
+    const int width = 48, height = 32;
+    auto winner = WFC::solvePortfolio(rules, width, height, 1, 4, 12345);
+    if (!winner) {
+        std::cerr << "The portfolio did not complete the grid." << std::endl;
+        return 1;
+    }
+    std::vector<unsigned char> first, second;
+    winner->renderImage(first);
+
+    winner->reset(width, height, winner->getSeed());
+    if (!winner->run() || !winner->isComplete()) {
+        std::cerr << "The winner could not be run again after reset()." << std::endl;
+        return 1;
+    }
+    winner->renderImage(second);
+    if (first != second) {
+        std::cerr << "The rerun of the winning seed gave a different grid." << std::endl;
+        return 1;
+    }
+    return 0;
+}